@@ -25,11 +25,14 @@ sub usage
     printf STDERR "Usage: $0 [-hve] [-t <tracenum>]\n";
     printf STDERR "$0 [-hve] [1|2]\n";
     printf STDERR "$0 [-hve] -t <tracenum>\n";
+    printf STDERR "$0 [-hve] -t <tracenum> -R <refout> -S <tshout>\n";
     printf STDERR "Options:\n";
     printf STDERR "  -h              Print this message\n";
     printf STDERR "  -t <tracefile>  Check one <tracefile> (default: check all)\n";
     printf STDERR "  -v              Trace our progress\n";
     printf STDERR "  -e              Like -v, but trace output only on error\n";
+    printf STDERR "  -R <file>       Compare this reference output instead of running tshref\n";
+    printf STDERR "  -S <file>       Compare this output instead of running tsh\n";
     die "\n" ;
 }
 
@@ -485,31 +488,19 @@ sub check_trace40 {
 
 
 
-sub check_trace {
-
-    my $tracefile = $_[0];
-    my $driver = "./sdriver.pl";
-    my $tsh = "./tsh";
-    my $tshref = "./tshref";
-    my $tmpdir = "/tmp/tsh$$";
-
-    # Had to make these global for errexit() ... Ugh
-    $tshreffile = "$tmpdir/tshref.out";
-    $tshfile = "$tmpdir/tsh.out";
-
-    if ($verbose) {
-	print "\n**************************************\n";
-	print "* $0: Checking $tracefile...\n";
-	print "**************************************\n";
-    }
-    else {
-	print "Checking $tracefile...\n";
-    }
+#
+# run_drivers - Run the reference shell and then tsh on a trace, saving
+#     their output in $tshreffile and $tshfile
+#
+sub run_drivers {
+    my ($tracefile, $driver, $tsh, $tshref) = @_;
 
     (-e $tsh and -x $tsh) 
 	or die "$0: ERROR: $tsh not found or not executable\n";
     (-e $tshref and -x $tshref) 
 	or die "$0: ERROR: $tshref not found or not executable\n";
+    (-e $driver and -x $driver)
+	or die "$0: ERROR: $driver not found or not executable (make builds it)\n";
 
     system("rm -rf $tmpdir/*; mkdir $tmpdir") == 0
 	or die "$0: ERROR: Couldn't create $tmpdir directory\n";
@@ -544,7 +535,38 @@ sub check_trace {
 	print TSHFILE "$line"; 
     } 
     close TSH;
-    
+}
+
+sub check_trace {
+
+    my $tracefile = $_[0];
+    my $driver = "./tshdriver";
+    my $tsh = "./tsh";
+    my $tshref = "./tshref";
+    my $tmpdir = "/tmp/tsh$$";
+
+    # Had to make these global for errexit() ... Ugh
+    $tshreffile = "$tmpdir/tshref.out";
+    $tshfile = "$tmpdir/tsh.out";
+
+    if ($verbose) {
+	print "\n**************************************\n";
+	print "* $0: Checking $tracefile...\n";
+	print "**************************************\n";
+    }
+    else {
+	print "Checking $tracefile...\n";
+    }
+
+    # runtraces.pl runs the drivers itself and only wants the comparison
+    if ($opt_R and $opt_S) {
+	$tshreffile = $opt_R;
+	$tshfile = $opt_S;
+	$tmpdir = "";
+    } else {
+	run_drivers($tracefile, $driver, $tsh, $tshref);
+    }
+
     if ($verbose) {
 	printf "\n$0: Comparing reference outputs to your outputs...\n";
     }
@@ -624,15 +646,17 @@ sub check_trace {
     close(TSHREFFILE);
     
     # clean up
-    system("rm -rf $tmpdir") == 0
-	or die "$0: ERROR: Couldn't delete $tmpdir\n";
+    if ($tmpdir) {
+	system("rm -rf $tmpdir") == 0
+	    or die "$0: ERROR: Couldn't delete $tmpdir\n";
+    }
 }
 
 ##############
 # Main routine
 ##############
 
-getopts('hevt:');
+getopts('hevt:R:S:');
 if ($opt_h) {
     usage();
 }
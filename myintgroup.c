@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "vclock.h"
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -24,7 +25,7 @@ int main(int argc, char **argv)
     secs = atoi(argv[1]);
 
     for (i=0; i < secs; i++)
-       sleep(1);
+       vsleep(1);
 	
     pid = getpgid(0); 
 
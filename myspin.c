@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "vclock.h"
 
 int main(int argc, char **argv) 
 {
@@ -19,6 +20,6 @@ int main(int argc, char **argv)
     }
     secs = atoi(argv[1]);
     for (i=0; i < secs; i++)
-	sleep(1);
+	vsleep(1);
     exit(0);
 }
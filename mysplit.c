@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "vclock.h"
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -24,7 +25,7 @@ int main(int argc, char **argv)
 
     if (fork() == 0) { /* child */
 	for (i=0; i < secs; i++)
-	    sleep(1);
+	    vsleep(1);
 	exit(0);
     }
 
@@ -0,0 +1,250 @@
+/*
+ * parsebench.c - Time the shell's command line parser
+ *
+ * usage: parsebench [-h] [-n <reps>] <trace file>...
+ *
+ * Collects the command lines from the trace files (skipping comments,
+ * blank lines and driver directives like SLEEP), checks that tsh's
+ * parsecmdline splits each one the same way the old parseline +
+ * parseargs pair did, then times both over <reps> passes of the lines.
+ *
+ * This file includes tsh.c with TSH_NO_MAIN, so it always measures the
+ * parser the shell is actually built with, arena resets included.
+ */
+#define TSH_NO_MAIN
+#include "tsh.c"
+
+#include <time.h>
+
+#define MAXCMDS 4096
+
+static char *lines[MAXCMDS];
+static int nlines;
+
+static void benchusage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-n <reps>] <trace file>...\n", prog);
+    fprintf(stderr, "   -h          print this message\n");
+    fprintf(stderr, "   -n <reps>   passes over the command lines (default 100000)\n");
+    exit(1);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * The parser tsh used before parsecmdline: copy the line, scan it with
+ * strchr, then walk argv again with strcmp to find the operators.
+ */
+static int oldparseline(const char *cmdline, char **argv)
+{
+    static char array[MAXLINE];
+    char *buf = array;
+    char *delim;
+    int argc;
+    int bg;
+
+    strcpy(buf, cmdline);
+    buf[strlen(buf)-1] = ' ';
+    while (*buf && (*buf == ' '))
+	buf++;
+
+    argc = 0;
+    if (*buf == '\'') {
+	buf++;
+	delim = strchr(buf, '\'');
+    }
+    else {
+	delim = strchr(buf, ' ');
+    }
+
+    while (delim) {
+	argv[argc++] = buf;
+	*delim = '\0';
+	buf = delim + 1;
+	while (*buf && (*buf == ' '))
+	       buf++;
+
+	if (*buf == '\'') {
+	    buf++;
+	    delim = strchr(buf, '\'');
+	}
+	else {
+	    delim = strchr(buf, ' ');
+	}
+    }
+    argv[argc] = NULL;
+
+    if (argc == 0)
+	return 1;
+
+    if ((bg = (*argv[argc-1] == '&')) != 0) {
+	argv[--argc] = NULL;
+    }
+    return bg;
+}
+
+static int oldparseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir)
+{
+    int argindex = 0;
+    int cmdindex = 0;
+    if (!argv[argindex]) {
+        return 0;
+    }
+
+    cmds[cmdindex] = argindex;
+    stdin_redir[cmdindex] = -1;
+    stdout_redir[cmdindex] = -1;
+    argindex++;
+    while (argv[argindex]) {
+        if (strcmp(argv[argindex], "<") == 0) {
+            argv[argindex] = NULL;
+            argindex++;
+            if (!argv[argindex]) {
+                break;
+	    }
+            stdin_redir[cmdindex] = argindex;
+	} else if (strcmp(argv[argindex], ">") == 0) {
+            argv[argindex] = NULL;
+            argindex++;
+            if (!argv[argindex]) {
+                break;
+	    }
+            stdout_redir[cmdindex] = argindex;
+	} else if (strcmp(argv[argindex], "|") == 0) {
+            argv[argindex] = NULL;
+            argindex++;
+            if (!argv[argindex]) {
+                break;
+	    }
+            cmdindex++;
+            cmds[cmdindex] = argindex;
+            stdin_redir[cmdindex] = -1;
+            stdout_redir[cmdindex] = -1;
+	}
+        argindex++;
+    }
+
+    return cmdindex + 1;
+}
+
+/* sameword - Compare two possibly NULL words */
+static int sameword(char *a, char *b)
+{
+    return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+/*
+ * check - Parse line both ways and complain if the stages differ. The
+ *    old parser let a redirect's file name end its stage's argv, so
+ *    only the words before the first operator are compared.
+ */
+static int check(char *line)
+{
+    struct cmdline_t *cl;
+    struct stage_t *stage;
+    char *argv[MAXLINE];
+    int cmds[MAXLINE], in[MAXLINE], out[MAXLINE];
+    int bg, n, i, j, ok = 1;
+
+    bg = oldparseline(line, argv);
+    n = oldparseargs(argv, cmds, in, out);
+    cl = parsecmdline(line, &cmdarena);
+    if (cl == NULL || cl->ncmds != n || (n > 0 && cl->bg != bg))
+	ok = 0;
+    for (i = 0, stage = ok ? cl->stages : NULL; stage != NULL; i++, stage = stage->next) {
+	for (j = 0; argv[cmds[i] + j] != NULL; j++)
+	    if (!sameword(argv[cmds[i] + j], stage->argv[j]))
+		ok = 0;
+	if (!sameword(in[i] < 0 ? NULL : argv[in[i]], stage->infile) ||
+	    !sameword(out[i] < 0 ? NULL : argv[out[i]], stage->outfile))
+	    ok = 0;
+    }
+    arenareset(&cmdarena);
+    return ok;
+}
+
+/* readtrace - Add the command lines in one trace file to lines[] */
+static void readtrace(char *filename)
+{
+    char buf[MAXLINE];
+    char *p;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+	perror(filename);
+	exit(1);
+    }
+    while (fgets(buf, MAXLINE, fp) != NULL && nlines < MAXCMDS) {
+	for (p = buf; isupper((unsigned char) *p); p++)
+	    ;
+	if (buf[0] == '#' || buf[0] == '\n' || p > buf) /* comment, blank, directive */
+	    continue;
+	if (strchr(buf, '\n') == NULL)
+	    strcat(buf, "\n");
+	lines[nlines++] = strdup(buf);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    char *oargv[MAXLINE];
+    int cmds[MAXLINE], in[MAXLINE], out[MAXLINE];
+    int c, i, r, reps = 100000;
+    long oldstages = 0, newstages = 0;
+    double start, oldns, newns;
+
+    while ((c = getopt(argc, argv, "hn:")) != EOF) {
+	switch (c) {
+	case 'n':
+	    reps = atoi(optarg);
+	    break;
+	default:
+	    benchusage(argv[0]);
+	}
+    }
+    if (optind == argc || reps < 1)
+	benchusage(argv[0]);
+    for (i = optind; i < argc; i++)
+	readtrace(argv[i]);
+    if (nlines == 0) {
+	fprintf(stderr, "%s: no command lines found\n", argv[0]);
+	exit(1);
+    }
+
+    for (i = 0; i < nlines; i++)
+	if (!check(lines[i])) {
+	    fprintf(stderr, "%s: parsers disagree on: %s", argv[0], lines[i]);
+	    exit(1);
+	}
+
+    start = now_ns();
+    for (r = 0; r < reps; r++)
+	for (i = 0; i < nlines; i++) {
+	    oldparseline(lines[i], oargv);
+	    oldstages += oldparseargs(oargv, cmds, in, out);
+	}
+    oldns = (now_ns() - start) / ((double) reps * nlines);
+
+    start = now_ns();
+    for (r = 0; r < reps; r++)
+	for (i = 0; i < nlines; i++) {
+	    newstages += parsecmdline(lines[i], &cmdarena)->ncmds;
+	    arenareset(&cmdarena);
+	}
+    newns = (now_ns() - start) / ((double) reps * nlines);
+
+    /* The counts match (check saw to that); printing them keeps the
+       loops from being optimized away */
+    if (oldstages != newstages)
+	fprintf(stderr, "%s: stage counts differ\n", argv[0]);
+    printf("%d command lines x %d passes (%ld stages)\n", nlines, reps, newstages);
+    printf("parseline + parseargs: %.1f ns/line\n", oldns);
+    printf("parsecmdline:          %.1f ns/line (%.2fx)\n", newns, oldns / newns);
+    exit(0);
+}
@@ -0,0 +1,242 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use FileHandle;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(time);
+use File::Temp qw(tempdir);
+use Cwd;
+
+####################################################################
+# runtraces.pl - run the trace suite in parallel
+#
+# Runs every trace (all trace*.txt by default) against the reference
+# shell and tsh, up to <jobs> traces at a time. Each trace runs in its
+# own temp directory of symlinks to this one, so the TEMPFILE files the
+# driver makes can't collide, and its two shells run side by side. The
+# outputs are compared by checktsh.pl -R/-S, the same way checktsh.pl
+# compares them itself.
+#
+# Traces that run /bin/ps count processes by name, and without a
+# terminal ps T sees every process on the machine, so those traces run
+# alone, one shell at a time, once everything else has finished.
+#
+# Each shell is driven by tshdriver. With -V it runs the traces in
+# virtual time (tshdriver -V), which takes the sleeping out of the suite.
+#
+# A trace whose reference run hit tshref's setpgid race (or gave up
+# waiting) is run again, up to three times in all. Such traces are
+# flagged with their run count, and counted in the summary, so flaky
+# runs stay visible.
+#
+####################################################################
+
+# Always flush stdout and stderr
+STDOUT->autoflush();
+STDERR->autoflush();
+
+#
+# usage - Print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-hvV] [-j <jobs>] [-s <shell>] [trace files...]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h         Print this message\n";
+    printf STDERR "  -v         Print the checker's output for failing traces\n";
+    printf STDERR "  -j <jobs>  Traces to run at once (default: CPUs, at least 8;\n";
+    printf STDERR "             the traces mostly sleep)\n";
+    printf STDERR "  -s <shell> Shell to test (default: ./tsh)\n";
+    printf STDERR "  -V         Run the traces in virtual time\n";
+    die "\n";
+}
+
+#
+# ncpus - Number of online CPUs
+#
+sub ncpus
+{
+    my $n = `getconf _NPROCESSORS_ONLN 2>/dev/null`;
+    chomp($n);
+    return ($n =~ /^\d+$/ && $n > 0) ? $n : 1;
+}
+
+#
+# exclusive - True if a trace needs the machine to itself
+#
+sub exclusive
+{
+    my ($tracefile) = @_;
+    my ($line, $found);
+
+    open(TRACE, "$tracefile")
+	or die "$0: ERROR: Couldn't open $tracefile\n";
+    $found = 0;
+    while ($line = <TRACE>) {
+	if ($line =~ /^\/bin\/ps\b/) {
+	    $found = 1;
+	}
+    }
+    close(TRACE);
+    return $found;
+}
+
+#
+# rundriver - Start the driver on one shell in the background, output to
+#     outfile. Returns the pid.
+#
+sub rundriver
+{
+    my ($tracefile, $shell, $outfile) = @_;
+    my $pid;
+
+    defined($pid = fork())
+	or die "$0: ERROR: fork failed\n";
+    if ($pid == 0) {
+	open(STDOUT, ">$outfile")
+	    or die "$0: ERROR: Couldn't open $outfile\n";
+	open(STDERR, ">&STDOUT");
+	exec("./tshdriver", ($vtime ? ("-V") : ()), "-t", $tracefile, "-s", $shell, "-a", "-p");
+	die "$0: ERROR: Couldn't run the driver\n";
+    }
+    return $pid;
+}
+
+#
+# runtrace - Child process for one trace: run both shells in a temp dir,
+#     compare, and exit 0 if it passed. The checker's output goes to
+#     $dir/out/check, and the number of runs it took to $dir/out/runs.
+#
+sub runtrace
+{
+    my ($tracefile, $dir, $serial) = @_;
+    my ($entry, $refpid, $tshpid, $status, $try);
+
+    chdir($dir)
+	or die "$0: ERROR: Couldn't enter $dir\n";
+    foreach $entry (glob("$topdir/*")) {
+	$entry =~ m{([^/]+)$};
+	symlink($entry, $1);
+    }
+    unlink("tsh");
+    symlink($shell =~ m{^/} ? $shell : "$topdir/$shell", "tsh");
+
+    # Outputs go in a subdirectory: the symlinks include files like
+    # tshref.out that must not be written through
+    mkdir("out")
+	or die "$0: ERROR: Couldn't create $dir/out\n";
+
+    # tshref calls setpgid on children that may have exec'd already, and
+    # then fails the whole trace; that is its race, so try again. Under
+    # load it can also be slow enough that a WAIT directive gives up.
+    for ($try = 0; $try < 3; $try++) {
+	$refpid = rundriver($tracefile, "./tshref", "out/ref");
+	waitpid($refpid, 0) if ($serial);
+	$tshpid = rundriver($tracefile, "./tsh", "out/tsh");
+	waitpid($refpid, 0) if (!$serial);
+	waitpid($tshpid, 0);
+	# Match the messages themselves: traces that run /bin/ps put every
+	# process's command line in the output, and any of them may mention
+	# these words
+	last if (`cat out/ref` !~ /(^|> )setpgid error:|^\S*tshdriver: WAIT\w+ .*: gave up$/m);
+    }
+    open(RUNS, ">out/runs")
+	or die "$0: ERROR: Couldn't create $dir/out/runs\n";
+    print RUNS ($try < 3 ? $try + 1 : 3), "\n";
+    close(RUNS);
+
+    $status = system("./checktsh.pl -t $tracefile -R out/ref -S out/tsh > out/check 2>&1");
+    exit($status == 0 && `cat out/check` =~ /Passed!/ ? 0 : 1);
+}
+
+##############
+# Main routine
+##############
+
+getopts('hvVj:s:');
+if ($opt_h) {
+    usage();
+}
+$verbose = $opt_v;
+$vtime = $opt_V;
+$shell = $opt_s ? $opt_s : "tsh";
+$shell =~ s{^\./}{};
+$jobs = $opt_j ? $opt_j : (ncpus() > 8 ? ncpus() : 8);
+$jobs > 0
+    or usage("$0: ERROR: -j needs a positive number");
+$topdir = getcwd();
+$tmpdir = tempdir("runtraces-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+
+@traces = @ARGV ? @ARGV : sort(glob("trace*.txt"));
+@traces > 0
+    or usage("$0: ERROR: no trace files");
+foreach $tracefile (@traces) {
+    (-e $tracefile)
+	or die "$0: ERROR: $tracefile not found\n";
+}
+
+# Everything else first, the traces that need the machine alone after
+@queue = ((grep { !exclusive($_) } @traces), (grep { exclusive($_) } @traces));
+
+$start = time();
+%running = ();                  # pid -> trace file
+%started = ();                  # trace file -> start time
+%wall = ();                     # trace file -> seconds it took
+@failed = ();
+@rerun = ();                    # traces that took more than one run
+$serialtime = 0;
+
+while (@queue || %running) {
+    # Start what we can: an exclusive trace only on an idle machine
+    while (@queue && scalar(keys %running) < $jobs &&
+	   !(exclusive($queue[0]) && %running) &&
+	   !grep { exclusive($_) } values %running) {
+	$tracefile = shift(@queue);
+	$dir = "$tmpdir/$tracefile";
+	mkdir($dir)
+	    or die "$0: ERROR: Couldn't create $dir\n";
+	defined($pid = fork())
+	    or die "$0: ERROR: fork failed\n";
+	if ($pid == 0) {
+	    runtrace($tracefile, $dir, exclusive($tracefile));
+	}
+	$running{$pid} = $tracefile;
+	$started{$tracefile} = time();
+    }
+
+    # Then wait for one to finish
+    $pid = waitpid(-1, 0);
+    next if (!defined($running{$pid}));
+    $tracefile = delete($running{$pid});
+    $wall{$tracefile} = time() - $started{$tracefile};
+    $serialtime += $wall{$tracefile};
+    $status = $?;
+    $runs = `cat $tmpdir/$tracefile/out/runs 2>/dev/null`;
+    chomp($runs);
+    $note = "";
+    if ($runs =~ /^\d+$/ && $runs > 1) {
+	$note = " ($runs runs: tshref setpgid error or gave up)";
+	push(@rerun, $tracefile);
+    }
+    if ($status == 0) {
+	printf "%-12s pass %6.2fs%s\n", $tracefile, $wall{$tracefile}, $note;
+    } else {
+	printf "%-12s FAIL %6.2fs%s\n", $tracefile, $wall{$tracefile}, $note;
+	push(@failed, $tracefile);
+	if ($verbose) {
+	    print `cat $tmpdir/$tracefile/out/check`;
+	}
+    }
+}
+
+printf "%d of %d traces passed in %.2fs (%.2fs if run one at a time), %d needed more than one run\n",
+    scalar(@traces) - scalar(@failed), scalar(@traces), time() - $start, $serialtime,
+    scalar(@rerun);
+if (@rerun) {
+    print "Rerun: @rerun\n";
+}
+if (@failed) {
+    print "Failed: @failed\n";
+    exit(1);
+}
+exit(0);
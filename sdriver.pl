@@ -4,6 +4,8 @@ use Getopt::Std;
 use FileHandle;
 use IPC::Open2;
 use File::Temp qw/ tempfile tempdir /;
+use IO::Select;
+use Time::HiRes qw/ sleep time /;
 
 #######################################################################
 # sdriver.pl - Shell driver
@@ -33,7 +35,27 @@ use File::Temp qw/ tempfile tempdir /;
 #     KILL        Send a SIGKILL signal to the child
 #     CLOSE       Close Writer (sends EOF signal to child)
 #     WAIT        Wait() for child to terminate
-#     SLEEP <n>   Sleep for <n> seconds
+#     SLEEP <n>   Sleep for <n> seconds (fractions allowed: SLEEP 0.2)
+#     WAITOUTPUT <regex>
+#                 Wait until the shell's output since the last WAITOUTPUT
+#                 matches the Perl regex <regex>
+#     WAITJOBS <state> [<n>]
+#                 Wait until at least <n> (default 1) of the shell's child
+#                 processes are running or stopped, as <state> says, or
+#                 with WAITJOBS none until the shell has no children left.
+#                 A child counts as running once it has exec'd; the shell
+#                 may not have added its job yet, so put a short SLEEP
+#                 after it before sending a signal.
+#
+# The WAIT* directives give up after $waitlimit seconds with a warning
+# on stderr, and the trace goes on.
+#
+# Virtual time (-V): the test programs sleep on a clock file named in
+# TSH_VCLOCK (see vclock.h), and SLEEP advances that clock instead of
+# sleeping. It goes 100ms at a time, and before each step, and before
+# each signal, the driver waits until the shell and everything it
+# started are blocked, so events keep the order real time gives them.
+# After the last line the clock keeps running until the shell is done.
 # 
 ######################################################################
 
@@ -51,11 +73,154 @@ sub usage
     printf STDERR "  -s <shell>    Shell program to test\n";
     printf STDERR "  -a <args>     Shell arguments\n";
     printf STDERR "  -g            Generate output for autograder\n";
+    printf STDERR "  -V            Run the test programs on a virtual clock\n";
     die "\n" ;
 }
 
+#
+# readoutput - Collect whatever the shell has written within timeout
+#     seconds onto $output. Returns 0 at end of file.
+#
+sub readoutput
+{
+    my ($timeout) = @_;
+    my ($buf);
+
+    return 1 if ($eof || !$selector->can_read($timeout));
+    return 0 if (!sysread(Reader, $buf, 4096));
+    $output .= $buf;
+    return 1;
+}
+
+#
+# procs - Scan /proc: fills %procstate (pid -> state letter) and
+#     %procparent (pid -> parent pid)
+#
+sub procs
+{
+    my ($stat);
+
+    %procstate = ();
+    %procparent = ();
+    foreach $stat (glob("/proc/[0-9]*/stat")) {
+	open(STAT, $stat) or next;
+	$_ = <STAT>;
+	close(STAT);
+	# pid (comm) state ppid ...; comm may hold spaces and parens
+	if (/^(\d+) \(.*\) (\S) (\d+) /) {
+	    $procstate{$1} = $2;
+	    $procparent{$1} = $3;
+	}
+    }
+}
+
+#
+# children - The shell's child processes that have exec'd, as a hash
+#     of pid -> state letter from /proc/<pid>/stat
+#
+sub children
+{
+    my (%kids, $shellexe);
+
+    $shellexe = readlink("/proc/$pid/exe");
+    procs();
+    foreach (keys %procparent) {
+	if ($procparent{$_} == $pid && readlink("/proc/$_/exe") ne $shellexe) {
+	    $kids{$_} = $procstate{$_};
+	}
+    }
+    return %kids;
+}
+
+#
+# quiet - True if the shell and every process it started (still
+#     counting ones orphaned since) are blocked, stopped or dead
+#
+sub quiet
+{
+    my ($grew, $p);
+
+    procs();
+    $tracked{$pid} = 1;
+    do {
+	$grew = 0;
+	foreach $p (keys %procparent) {
+	    if (!$tracked{$p} && $tracked{$procparent{$p}}) {
+		$tracked{$p} = 1;
+		$grew = 1;
+	    }
+	}
+    } while ($grew);
+    foreach $p (keys %tracked) {
+	if (!defined($procstate{$p})) {
+	    delete($tracked{$p});
+	} elsif ($procstate{$p} =~ /[RD]/) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+#
+# settle - Wait (in real time) until three looks in a row find every
+#     process quiet, draining the shell's output meanwhile
+#
+sub settle
+{
+    my ($n, $deadline);
+
+    $n = 0;
+    $deadline = time() + $waitlimit;
+    while ($n < 3 && time() < $deadline) {
+	readoutput(0) or $eof = 1;
+	$n = quiet() ? $n + 1 : 0;
+	sleep(0.001);
+    }
+}
+
+#
+# setclock - Set the virtual clock to $vnow ms
+#
+sub setclock
+{
+    sysseek(VCLOCK, 0, 0);
+    syswrite(VCLOCK, sprintf("%020d\n", $vnow));
+}
+
+#
+# vsleep - SLEEP in virtual time: advance the clock by secs seconds
+#
+sub vsleep
+{
+    my ($secs) = @_;
+    my ($target) = $vnow + int($secs * 1000 + 0.5);
+
+    settle();
+    while ($vnow < $target) {
+	$vnow = $target - $vnow > 100 ? $vnow + 100 : $target;
+	setclock();
+	settle();
+    }
+}
+
+#
+# jobsreached - True if the shell's children match a WAITJOBS directive
+#
+sub jobsreached
+{
+    my ($state, $n) = @_;
+    my (%kids) = children();
+    my ($count) = 0;
+
+    return (keys %kids) == 0 if ($state eq "none");
+    foreach (values %kids) {
+	$count++ if (($state eq "stopped") == ($_ eq "T"));
+    }
+    return $count >= $n;
+}
+
 # Parse the command line arguments
-getopts('hgvt:s:a:');
+getopts('hgvVt:s:a:');
 if ($opt_h) {
     usage();
 }
@@ -70,6 +235,7 @@ $infile = $opt_t;
 $shellprog = $opt_s;
 $shellargs = $opt_a;
 $grade = $opt_g;
+$vtime = $opt_V;
 
 # Make sure the input script exists and is readable
 -e $infile
@@ -88,6 +254,17 @@ $grade = $opt_g;
 open INFILE, $infile
     or die "$0: ERROR: Couldn't open input file $infile: $!\n";
 
+# The virtual clock, which everything the shell runs inherits
+if ($vtime) {
+    (undef, $vclockfile) = tempfile("tshclock-XXXXXX", TMPDIR => 1, UNLINK => 1);
+    open(VCLOCK, "+<", $vclockfile)
+	or die "$0: ERROR: Couldn't open $vclockfile: $!\n";
+    $vnow = 0;
+    setclock();
+    $ENV{TSH_VCLOCK} = $vclockfile;
+    %tracked = ();
+}
+
 # 
 # Fork a child, run the shell in it, and connect the parent
 # and child with a pair of unidirectional pipes: 
@@ -97,6 +274,13 @@ open INFILE, $infile
 $pid = open2(\*Reader, \*Writer, "$shellprog $shellargs");
 Writer->autoflush();
 
+# The shell's output is collected as it comes (WAITOUTPUT needs to see
+# it) but only printed at the end, after the comments, as it always was
+$selector = IO::Select->new(\*Reader);
+$output = "";
+$outmark = 0;                   # WAITOUTPUT matches only what comes after this
+$waitlimit = 10;                # seconds before a WAIT* directive gives up
+
 # The autograder will want to know the child shell's pid
 if ($grade) {
     print ("pid=$pid\n");
@@ -126,11 +310,46 @@ while (<INFILE>) {
 	}
     }
 
+    # Wait for the shell to print something
+    elsif ($line =~ /^WAITOUTPUT (.*)$/) {
+	$pattern = $1;
+	if ($verbose) {
+	    print "$0: Waiting for output matching /$pattern/\n";
+	}
+	$deadline = time() + $waitlimit;
+	pos($output) = $outmark;
+	while ($output !~ /$pattern/g) {
+	    if (time() >= $deadline || !readoutput($deadline - time())) {
+		print STDERR "$0: WAITOUTPUT $pattern: gave up\n";
+		last;
+	    }
+	    pos($output) = $outmark;
+	}
+	$outmark = defined(pos($output)) ? pos($output) : length($output);
+    }
+
+    # Wait for the shell's jobs to get somewhere
+    elsif ($line =~ /^WAITJOBS (running|stopped|none)(?: (\d+))?\s*$/) {
+	($state, $n) = ($1, defined($2) ? $2 : 1);
+	if ($verbose) {
+	    print "$0: Waiting for $n $state child processes\n";
+	}
+	$deadline = time() + $waitlimit;
+	while (!jobsreached($state, $n)) {
+	    if (time() >= $deadline) {
+		print STDERR "$0: WAITJOBS $state $n: gave up\n";
+		last;
+	    }
+	    readoutput(0.005) or sleep(0.005); # keep the pipe drained while we poll
+	}
+    }
+
     # Send SIGTSTP (ctrl-z)
     elsif ($line =~ /TSTP/) {
 	if ($verbose) {
 	    print "$0: Sending SIGTSTP signal to process $pid\n";
 	}
+	settle() if ($vtime);
 	kill 'TSTP', $pid;
     }
 
@@ -139,6 +358,7 @@ while (<INFILE>) {
 	if ($verbose) {
 	    print "$0: Sending SIGINT signal to process $pid\n";
 	}
+	settle() if ($vtime);
 	kill 'INT', $pid;
     }
 
@@ -147,6 +367,7 @@ while (<INFILE>) {
 	if ($verbose) {
 	    print "$0: Sending SIGQUIT signal to process $pid\n";
 	}
+	settle() if ($vtime);
 	kill 'QUIT', $pid;
     }
 
@@ -155,6 +376,7 @@ while (<INFILE>) {
 	if ($verbose) {
 	    print "$0: Sending SIGKILL signal to process $pid\n";
 	}
+	settle() if ($vtime);
 	kill 'KILL', $pid;
     }
 
@@ -178,11 +400,15 @@ while (<INFILE>) {
     }
 
     # Sleep
-    elsif ($line =~ /SLEEP (\d+)/) {
+    elsif ($line =~ /SLEEP (\d+(?:\.\d+)?)/) {
 	if ($verbose) {
 	    print "$0: Sleeping $1 secs\n";
 	}
-	sleep $1;
+	if ($vtime) {
+	    vsleep($1);
+	} else {
+	    sleep $1;
+	}
     }
 
     # Other input
@@ -218,6 +444,17 @@ close Writer;
 if ($verbose) {
     print "$0: Reading data from child $pid\n";
 }
+if ($vtime) {
+    # Let the clock run until the shell and its jobs are finished with the
+    # output pipe, then let anything still sleeping go
+    $eof = 0;
+    for ($i = 0; $i < 10000 && !$eof; $i++) {
+	vsleep(0.1);
+    }
+    $vnow = 1e15;
+    setclock();
+}
+print $output;
 while ($line = <Reader>) {
     print $line;
 }
@@ -226,6 +463,18 @@ close Reader;
 # Finally, parent reaps child
 wait;
 
+# In virtual time the next trace can start a moment later, so don't
+# leave it our processes (or their zombies, which init may be slow to
+# reap) to find. Stopped ones will never go away by themselves.
+if ($vtime) {
+    $deadline = time() + $waitlimit;
+    while (time() < $deadline) {
+	procs();
+	last if (!grep { defined($procstate{$_}) && $procstate{$_} ne "T" } keys %tracked);
+	sleep(0.005);
+    }
+}
+
 foreach $num (keys %tmpfilenames) {
     if ($verbose) {
         print "$0: Unlinking $tmpfilenames{$num}\n";
@@ -4,6 +4,7 @@
  * Name: Jacob West
  * NetID: wjacoba
  */
+#define _GNU_SOURCE       /* for pipe2 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,12 +14,48 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXJOBS      16   /* initial job list size; it grows on demand */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXPROCS     32   /* max commands in a pipeline */
+#define PIDHASH      64   /* initial pid index size; a power of 2 */
+#define CMDHASH      64   /* buckets in the command path cache */
+#define ARENACHUNK 16384  /* bytes per parse arena chunk; one MAXLINE line fits */
+#define CMDPOOL    1024   /* initial size of the command text pool */
+#define OUTBUF     8192   /* bytes in the output ring; a power of 2 */
+#define TRACERECS 65536   /* records in the -t trace ring; a power of 2 */
+#define CHLDRING    256   /* wait statuses sigchld_handler can queue; a power of 2 */
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2) /* pidfd_send_signal to the pgrp */
+#endif
+#define PIDEVENT (1ULL << 32) /* tags a pidfd's epoll data; low bits hold the pid */
+
+/* Trace event types (-t) */
+#define TR_ADDJOB  0 /* job added: arg = number of processes */
+#define TR_LAUNCH  1 /* process forked or spawned: arg = its process group */
+#define TR_EXEC    2 /* process about to exec (fork), or exec'd (posix_spawn) */
+#define TR_STOP    3 /* process stopped: arg = signal */
+#define TR_CONT    4 /* SIGCONT sent to the job */
+#define TR_REAP    5 /* process reaped: arg = wait status */
+#define TR_SIGNAL  6 /* other signal sent to the job: arg = signal */
+#define TR_DELJOB  7 /* job deleted */
+#define TR_NTYPES  8
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -26,20 +63,239 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Process states: each process of a job has one. The job is stopped
+ * once none of its live processes runs, and done once all are reaped. */
+#define PS_RUN  0 /* running, as far as we know */
+#define PS_STOP 1 /* stopped */
+#define PS_DONE 2 /* exited or killed, and reaped */
+
+struct stage_t {            /* One command of a pipeline */
+    char **argv;            /* its arguments, ending in NULL */
+    char *infile;           /* < file, or NULL */
+    char *outfile;          /* > file, or NULL */
+    struct stage_t *next;   /* next stage, NULL for the last */
+};
+
+struct cmdline_t {          /* A command line split into pipeline stages */
+    struct stage_t *stages; /* first stage, NULL for a blank line */
+    int ncmds;              /* number of stages, 0 for a blank line */
+    int bg;                 /* true if the line ends with & */
+    struct stage_t first;   /* the first stage, kept in place */
+};
+
+struct chunk_t {            /* One block of arena memory */
+    struct chunk_t *next;   /* next block, kept across resets */
+    size_t size;            /* usable bytes in data */
+    char data[];
+};
+
+struct arena_t {            /* Bump allocator for one command's parse state */
+    struct chunk_t *first;  /* first block, NULL until something is allocated */
+    struct chunk_t *cur;    /* block being allocated from */
+    size_t used;            /* bytes of cur handed out */
+};
+
 /* Global variables */
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int usefork = 0;            /* if true, launch jobs with fork+execve, not posix_spawn */
+int useevents = 0;          /* if true, take signals from a signalfd in an epoll loop */
+sigset_t childmask;         /* signal mask the shell started with, for its children */
+int batchout = 0;           /* if true, stdout is flushed in batches, not per command (-f) */
+int maxbgjobs = 0;          /* most background jobs allowed to run at once, 0 for no cap (-j) */
+int dumpstats = 0;          /* if true, print the stats counters at exit (-s) */
 int nextjid = 1;            /* next job ID to allocate */
+struct arena_t cmdarena;    /* parse state of the command being evaluated */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct jobusage_t {         /* Resources used by a job's reaped processes */
+    long long utime;        /* user CPU, in microseconds */
+    long long stime;        /* system CPU, in microseconds */
+    long long wall;         /* launch to last reap, in nanoseconds (finished jobs) */
+    long maxrss;            /* largest max RSS of any of them, in KiB */
+    long nvcsw;             /* voluntary context switches */
+    long nivcsw;            /* involuntary context switches */
+};
+
+struct proc_t {             /* One process of a job */
+    pid_t pid;              /* its PID */
+    int pidfd;              /* its pidfd, -1 once it is reaped */
+    int state;              /* PS_RUN, PS_STOP or PS_DONE */
+};
+
 struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int nprocs;             /* number of processes in the pipeline */
+    int nlive;              /* processes not yet reaped */
+    int nstopped;           /* processes in PS_STOP */
+    int stopsig;            /* signal that stopped the latest of them */
+    int status;             /* wait status of the last stage, once reaped */
+    int nextfree;           /* next slot on the free list, if this one is free */
+    int par;                /* true while the par builtin is waiting on it */
+    unsigned int cmdoff;    /* its command line's entry in cmdpool, 0 if none */
+    unsigned int cmdlen;    /* length of the command line */
+    long long started;      /* launch time, CLOCK_MONOTONIC nanoseconds */
+    struct jobusage_t usage; /* what its reaped processes used */
+    struct proc_t proc;     /* the process, if there is just one */
+    int procoff;            /* else the first of them in procpool */
+};
+
+struct cmdstr_t {           /* One interned command line in cmdpool */
+    unsigned int refs;      /* jobs using it; 0 once it is garbage */
+    unsigned int len;       /* bytes of text, not counting the '\0' */
+    unsigned int next;      /* next entry in its hash bucket, 0 for none */
+    char text[];            /* the command line */
+};
+
+/* Text of job's command line */
+#define jobcmdline(job) (((struct cmdstr_t *) (cmdpool + (job)->cmdoff))->text)
+
+/* job's processes, one per pipeline stage; [0] is the one with PID job->pid */
+#define jobprocs(job) ((job)->nprocs > 1 ? procpool + (job)->procoff : &(job)->proc)
+
+/*
+ * The job list grows on demand, but only from the main loop with the
+ * job-control signals blocked (see growjobs). The ctrl-c/ctrl-z
+ * handlers just read entries, and sigchld_handler leaves the list to
+ * drainchld, so no handler allocates or sees a half-moved array.
+ */
+struct job_t *jobs;         /* The job list */
+int maxjobs;                /* number of slots in jobs */
+int freejob = -1;           /* first free slot, -1 if the list is full */
+
+/*
+ * Command lines live in one pool, each distinct text once, so a job
+ * record carries just an offset. Deleting a job only drops a reference;
+ * the pool is compacted or grown from addjob, with the job-control
+ * signals blocked, like the job list itself.
+ */
+char *cmdpool;              /* struct cmdstr_t entries, back to back */
+unsigned int cmdpoolsize;   /* bytes in cmdpool */
+unsigned int cmdpoolused;   /* bytes taken by entries, live or garbage */
+unsigned int cmdpooldead;   /* bytes taken by garbage entries */
+unsigned int cmdpoolindex[CMDHASH]; /* text hash -> first entry, 0 for none */
+
+/*
+ * A pipeline's processes live in a block of MAXPROCS entries in
+ * procpool; a one-process job keeps its process in the job record, so
+ * the job list stays a few cache lines per job. The pool grows like
+ * the job list. A free block's first pid links to the next free block.
+ */
+struct proc_t *procpool;    /* the blocks, back to back */
+int procblocks;             /* number of blocks in procpool */
+int freeprocs = -1;         /* offset of the first free block, -1 if none */
+
+/* Indexes over the job list so lookups don't have to scan it */
+struct pidslot_t {          /* One open-addressed pid index entry */
+    pid_t pid;              /* process PID, 0 if the entry is empty */
+    int slot;               /* index of its job in jobs[] */
+    int member;             /* index of the process in jobprocs(job) */
+};
+struct pidslot_t *pidindex; /* PID of any job process -> slot */
+unsigned int pidhashsize;   /* slots in pidindex, a power of 2 */
+unsigned int pidcount;      /* PIDs currently in pidindex */
+int *jidindex;              /* JID -> slot, -1 if the JID is free */
+int jidcap;                 /* entries in jidindex */
+int fgslot = -1;            /* slot of the foreground job, -1 if none */
+int nbgjobs = 0;            /* jobs in the BG state */
+
+struct cmdpath_t {          /* One command path cache entry */
+    char *name;             /* command name as typed */
+    char *path;             /* where PATH search found it */
+    int hits;               /* times it has been run from the cache */
+    struct cmdpath_t *next; /* next entry in the same bucket */
+};
+struct cmdpath_t *cmdcache[CMDHASH]; /* command name -> resolved path */
+char *cmdcachepath;         /* value of PATH the cache was built from */
+
+/* Accounting for finished jobs (times) */
+struct jobusage_t doneusage; /* totals over every finished job */
+int donejobs = 0;           /* jobs finished */
+
+/* time keyword state: the job being timed and when each step ended */
+struct timing_t {
+    pid_t pid;              /* job being timed, 0 if none */
+    long long start;        /* eval entered */
+    long long parsed;       /* parsecmdline returned */
+    long long spawned;      /* last stage forked/spawned */
+    long long firstchld;    /* first of its processes reaped */
+    long long reaped;       /* last of them reaped */
+    struct jobusage_t usage; /* copied from the job when it finishes */
+} timed;
+
+/* Hot-path counters (stats, -s). Plain increments: each one is only
+ * ever bumped from one side of the handler/main-loop line. */
+struct stats_t {
+    unsigned long evals;    /* command lines evaluated */
+    unsigned long launches; /* processes forked or spawned */
+    unsigned long execfails; /* commands that could not be started */
+    unsigned long sigchlds; /* SIGCHLD deliveries (handler runs, signalfd reads) */
+    unsigned long reaps;    /* children reaped or seen stopping */
+    unsigned long reapruns; /* sigchld_handler runs */
+    unsigned long maxreaps; /* most children reaped by one sigchld_handler run */
+    unsigned long fgwakeups; /* times waitfg woke up to recheck */
+    unsigned long sigprocmasks; /* sigprocmask calls in the shell */
+    int jobs;               /* jobs in the table now */
+    int jobshigh;           /* most jobs in the table at once */
+} stats;
+
+/* Event trace ring (-t): a header and TRACERECS records in a shared
+ * file mapping. Appends are one atomic add plus a store, so the signal
+ * handlers and a forked child about to exec can write it too. */
+struct tracehdr_t {
+    char magic[8];          /* "tshtrace" */
+    uint32_t recsize;       /* sizeof(struct tracerec_t) */
+    uint32_t nrecs;         /* records in the ring */
+    uint64_t head;          /* records ever appended; next goes at head % nrecs */
+};
+struct tracerec_t {
+    int64_t ns;             /* CLOCK_MONOTONIC time */
+    int32_t type;           /* TR_* */
+    int32_t pid;            /* process, or the job's first process */
+    int32_t jid;            /* job, 0 if not known yet */
+    int32_t arg;            /* depends on type */
+};
+struct tracehdr_t *tracering = NULL; /* NULL when not tracing */
+char *tracenames[TR_NTYPES] = {
+    "addjob", "launch", "exec", "stop", "cont", "reap", "signal", "deljob"
+};
+
+/* par builtin state */
+int parlive = 0;            /* par jobs still running */
+int parfailed = 0;          /* par jobs that exited nonzero or were killed */
+int parhalt = 0;            /* set by ctrl-c/ctrl-z: start no more par jobs */
+
+/* Output ring: everything the shell prints goes through outf */
+char outring[OUTBUF];       /* text waiting to be written */
+unsigned int outhead = 0;   /* bytes written so far (mod OUTBUF: start of pending text) */
+unsigned int outtail = 0;   /* bytes queued so far (mod OUTBUF: end of pending text) */
+
+/* Child ring: sigchld_handler only reaps and queues each wait status;
+ * drainchld applies them to the job list from the main loop. One
+ * producer (the handler) and one consumer, so the indices need no lock. */
+struct chldevent_t {
+    pid_t pid;              /* child waitpid reported */
+    int status;             /* its wait status */
+    long long ns;           /* CLOCK_MONOTONIC time it was reaped */
+    struct rusage ru;       /* what it used, if it was reaped */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct chldevent_t chldring[CHLDRING];
+unsigned int chldhead = 0;  /* statuses applied (written by the main loop) */
+unsigned int chldtail = 0;  /* statuses queued (written by the handler) */
+volatile sig_atomic_t chldfull = 0; /* the handler stopped reaping: ring full */
+
+/* Event loop state (-e) */
+int sigfd = -1;             /* signalfd for SIGCHLD, SIGINT and SIGTSTP */
+int jobepfd = -1;           /* epoll set of job events: signalfd + pidfds */
+int mainepfd = -1;          /* epoll set for the main loop: stdin + jobepfd */
+int stdinpollable = 1;      /* false if stdin is a file epoll can't watch */
+char inbuf[MAXLINE];        /* input read from stdin but not yet evaluated */
+int inlen = 0;              /* bytes in inbuf */
+int ineof = 0;              /* true once stdin has hit end of file */
+int pidfdsok = 1;           /* false if some job process has no pidfd */
 /* End global variables */
 
 /* Function prototypes */
@@ -49,26 +305,62 @@ void eval(char *cmdline);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
+void waitbg(int limit);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void reapchild(pid_t pid, int status, struct rusage *ru, long long ns);
+void drainchld(void);
+void stopjob(struct job_t *job);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
-int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir);
+struct cmdline_t *parsecmdline(const char *cmdline, struct arena_t *arena);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+void initjobs(void);
+int maxjid(void); 
+int addjob(struct job_t *jobs, pid_t *pids, int nprocs, int state, char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid); 
+void removejob(struct job_t *job);
+void procdone(struct job_t *job, int member);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid, int *member);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
+void setjobstate(struct job_t *job, int state);
+int signaljob(struct job_t *job, int sig);
 void listjobs(struct job_t *jobs);
+void listjobslong(struct job_t *jobs);
+void do_times(void);
+long long nowns(void);
+
+void initevents(void);
+void handleevents(int timeout);
+char *eventreadline(char *cmdline);
+
+void runscript(char *filename);
+
+char *findcommand(char *name);
+void forgetcommand(char *name);
+void clearcommands(void);
+void do_hash(char **argv);
+
+void do_par(char **argv);
+void timereport(struct jobusage_t *u, long long reaped);
+void printstats(void);
+void opentrace(char *filename);
+void traceevent(int type, pid_t pid, int jid, int arg);
+void quitshell(void);
+void signalpar(int sig);
+
+void *arenaalloc(struct arena_t *arena, size_t n);
+void arenareset(struct arena_t *arena);
+
+void outf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void outflush(void);
 
 void usage(void);
 void unix_error(char *msg);
@@ -76,6 +368,7 @@ void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 
+#ifndef TSH_NO_MAIN /* parsebench.c links in everything but main */
 /*
  * main - The shell's main routine 
  */
@@ -83,6 +376,7 @@ int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
+    char *script = NULL; /* command file to run instead of reading stdin */
     int emit_prompt = 1; /* emit prompt (default) */
 
     /* Redirect stderr to stdout (so that driver will get all output
@@ -90,7 +384,7 @@ int main(int argc, char **argv)
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpsFef:j:t:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -101,6 +395,25 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 's':             /* print the stats counters at exit */
+            dumpstats = 1;
+	    break;
+        case 'F':             /* launch jobs the old way, with fork */
+            usefork = 1;
+	    break;
+        case 'e':             /* handle signals synchronously from an event loop */
+            useevents = 1;
+	    break;
+        case 'f':             /* run a command file, then exit */
+            script = optarg;
+	    break;
+        case 'j':             /* cap the number of running background jobs */
+            if ((maxbgjobs = atoi(optarg)) < 1)
+                usage();
+	    break;
+        case 't':             /* record job events in a binary trace file */
+            opentrace(optarg);
+	    break;
 	default:
             usage();
 	}
@@ -117,147 +430,152 @@ int main(int argc, char **argv)
     Signal(SIGQUIT, sigquit_handler); 
 
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs();
+
+    /* Children get the mask we started with, whatever we block later */
+    sigprocmask(SIG_BLOCK, NULL, &childmask);
+    if (useevents)
+	initevents();
+
+    if (script != NULL)
+	runscript(script); /* does not return */
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
 	/* Read command line */
-	if (emit_prompt) {
-	    printf("%s", prompt);
-	    fflush(stdout);
-	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
-	    fflush(stdout);
-	    exit(0);
+	/* The command's output, any job notices and the prompt go out in one write */
+	drainchld();
+	if (emit_prompt)
+	    outf("%s", prompt);
+	outflush();
+	if (useevents) {
+	    if (eventreadline(cmdline) == NULL) /* End of file (ctrl-d) */
+		quitshell();
+	} else {
+	    if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
+		app_error("fgets error");
+	    if (feof(stdin)) /* End of file (ctrl-d) */
+		quitshell();
 	}
 
-	/* Evaluate the command line */
+	/* Catch up on jobs that changed while we waited, then evaluate
+	 * the command line and drop its parse state */
+	drainchld();
 	eval(cmdline);
-	fflush(stdout);
-	fflush(stdout);
+	arenareset(&cmdarena);
     } 
 
     exit(0); /* control never reaches here */
 }
+#endif /* TSH_NO_MAIN */
 
 /* 
- * parseargs - Parse the arguments to identify pipelined commands
- * 
- * Walk through each of the arguments to find each pipelined command.  If the
- * argument was | (pipe), then the next argument starts the new command on the
- * pipeline.  If the argument was < or >, then the next argument is the file
- * from/to which stdin or stdout should be redirected, respectively.  After it
- * runs, the arrays for cmds, stdin_redir, and stdout_redir all have the same
- * number of items---which is the number of commands in the pipeline.  The cmds
- * array is populated with the indexes of argv corresponding to the start of
- * each command sequence in the pipeline.  For each slot in cmds, there is a
- * corresponding slot in stdin_redir and stdout_redir.  If the slot has a -1,
- * then there is no redirection; if it is >= 0, then the value corresponds to
- * the index in argv that holds the filename associated with the redirection.
+ * parsecmdline - Parse the command line into pipeline stages in a
+ *    single pass.
  * 
+ * Words are separated by spaces (and the trailing newline). A word that
+ * starts with a single quote runs to the next quote, spaces and all, and
+ * is never taken for an operator. The unquoted words |, < and > split
+ * stages and name redirect files; a last word starting with & makes the
+ * job a background job and is dropped. Word text is copied once, as it
+ * is scanned, into the arena, so cmdline itself is left intact for the
+ * job list. Everything returned lives in arena until it is reset, and
+ * nothing limits the number of words or stages.
+ *
+ * Returns NULL if an operator is missing its command or file name.
  */
-int parseargs(char **argv, int *cmds, int *stdin_redir, int *stdout_redir) 
+struct cmdline_t *parsecmdline(const char *cmdline, struct arena_t *arena) 
 {
-    int argindex = 0;    /* the index of the current argument in the current cmd */
-    int cmdindex = 0;    /* the index of the current cmd */
-    if (!argv[argindex]) {
-        return 0;
-    }
+    size_t len = strlen(cmdline);
+    struct cmdline_t *cl;       /* what we return */
+    struct stage_t *stage;      /* current stage */
+    const char *p = cmdline;    /* next character to scan */
+    char *out;                  /* where the next word's text goes */
+    char **argv;                /* where the next argv entry goes */
+    char *word;                 /* text of the current word */
+    char **redir = NULL;        /* where the next word goes if it's a file name */
+    int quoted;                 /* true if the current word was quoted */
+
+    /* Every word's '\0' takes the place of a separator (or ends the
+     * line), and argv needs at most one entry per word plus one NULL.
+     * One allocation holds the line with its first stage, the text and
+     * then argv; only a pipeline's later stages need more. */
+    cl = arenaalloc(arena, sizeof(*cl) + (len / 8 + 1 + len / 2 + 2) * sizeof(char *));
+    out = (char *) (cl + 1);
+    argv = (char **) (cl + 1) + len / 8 + 1;
+    stage = cl->stages = &cl->first;
+    stage->argv = argv;
+    stage->infile = stage->outfile = NULL;
+    stage->next = NULL;
+    cl->ncmds = 1;
+    cl->bg = 0;
 
-    cmds[cmdindex] = argindex;
-    stdin_redir[cmdindex] = -1;
-    stdout_redir[cmdindex] = -1;
-    argindex++;
-    while (argv[argindex]) {
-        if (strcmp(argv[argindex], "<") == 0) {
-            argv[argindex] = NULL;
-            argindex++;
-            if (!argv[argindex]) { /* if we have reached the end, then break */
-                break;
-	    }
-            stdin_redir[cmdindex] = argindex;
-	} else if (strcmp(argv[argindex], ">") == 0) {
-            argv[argindex] = NULL;
-            argindex++;
-            if (!argv[argindex]) { /* if we have reached the end, then break */
-                break;
-	    }
-            stdout_redir[cmdindex] = argindex;
-	} else if (strcmp(argv[argindex], "|") == 0) {
-            argv[argindex] = NULL;
-            argindex++;
-            if (!argv[argindex]) { /* if we have reached the end, then break */
-                break;
+    while (1) {
+	while (*p == ' ' || *p == '\n')
+	    p++;
+	if (*p == '\0')
+	    break;
+
+	/* Copy one word */
+	word = out;
+	if ((quoted = (*p == '\''))) {
+	    p++;
+	    while (*p != '\0' && *p != '\'' && *p != '\n')
+		*out++ = *p++;
+	    if (*p == '\'')
+		p++;
+	} else {
+	    while (*p != '\0' && *p != ' ' && *p != '\n')
+		*out++ = *p++;
+	}
+	*out++ = '\0';
+
+	if (!quoted && word[0] == '&') {
+	    while (*p == ' ' || *p == '\n')
+		p++;
+	    if (*p == '\0') {     /* last word: run in the background */
+		cl->bg = 1;
+		break;
 	    }
-            cmdindex++;
-            cmds[cmdindex] = argindex;
-            stdin_redir[cmdindex] = -1;
-            stdout_redir[cmdindex] = -1;
 	}
-        argindex++;
-    }
-
-    return cmdindex + 1;
-}
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
- */
-int parseline(const char *cmdline, char **argv) 
-{
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
-
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
-    }
-    else {
-	delim = strchr(buf, ' ');
-    }
-
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
-
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
-	}
-	else {
-	    delim = strchr(buf, ' ');
+	if (!quoted && word[1] == '\0' &&
+	    (word[0] == '|' || word[0] == '<' || word[0] == '>')) {
+	    if (redir != NULL)
+		return NULL;        /* operator where a file name belongs */
+	    if (word[0] == '<')
+		redir = &stage->infile;
+	    else if (word[0] == '>')
+		redir = &stage->outfile;
+	    else {
+		if (argv == stage->argv)
+		    return NULL;    /* | with no command before it */
+		*argv++ = NULL;
+		stage = stage->next = arenaalloc(arena, sizeof(*stage));
+		stage->argv = argv;
+		stage->infile = stage->outfile = NULL;
+		stage->next = NULL;
+		cl->ncmds++;
+	    }
+	} else if (redir != NULL) {
+	    *redir = word;
+	    redir = NULL;
+	} else {
+	    *argv++ = word;
 	}
     }
-    argv[argc] = NULL;
-    
-    if (argc == 0)  /* ignore blank line */
-	return 1;
+    *argv = NULL;
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
+    if (cl->ncmds == 1 && argv == stage->argv && redir == NULL &&
+	stage->infile == NULL && stage->outfile == NULL) {
+	cl->stages = NULL;          /* ignore blank line */
+	cl->ncmds = 0;
+	return cl;
     }
-    return bg;
+    if (redir != NULL || argv == stage->argv)
+	return NULL;                /* dangling operator */
+    return cl;
 }
 
 
@@ -270,10 +588,16 @@ int parseline(const char *cmdline, char **argv)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpsFe] [-f <script>] [-j <n>] [-t <tracefile>]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -s   print the shell's internal counters at exit\n");
+    printf("   -F   launch jobs with fork+execve instead of posix_spawn\n");
+    printf("   -e   read signals from a signalfd in an epoll loop instead of handlers\n");
+    printf("   -f   run the commands in file <script> instead of reading stdin\n");
+    printf("   -j   run at most <n> background jobs at a time\n");
+    printf("   -t   record job events in binary trace <tracefile> (see tshtrace)\n");
     exit(1);
 }
 
@@ -282,6 +606,7 @@ void usage(void)
  */
 void unix_error(char *msg)
 {
+    outflush();
     fprintf(stdout, "%s: %s\n", msg, strerror(errno));
     exit(1);
 }
@@ -291,6 +616,7 @@ void unix_error(char *msg)
  */
 void app_error(char *msg)
 {
+    outflush();
     fprintf(stdout, "%s\n", msg);
     exit(1);
 }
@@ -310,6 +636,7 @@ void protectedSetpgid(pid_t pid, pid_t processGroupId) {
 }
 
 void protectedSigprocmask(int operation, sigset_t *mask, sigset_t *old_mask) {
+    stats.sigprocmasks++;
     if(sigprocmask(operation, mask, old_mask) < 0) {
         app_error("Error calling sigprocmask().");
     }
@@ -333,6 +660,131 @@ void protectedKill(pid_t pid, int sig) {
     }
 }
 
+void protectedSignalJob(struct job_t *job, int sig) {
+    // ESRCH: the whole job is already reaped, waiting in the child ring
+    if(signaljob(job, sig) < 0 && errno != ESRCH) {
+        unix_error("Error signaling job.");
+    }
+}
+
+void protectedPipe2(int fds[2], int flags) {
+    if(pipe2(fds, flags) < 0) {
+        unix_error("Error calling pipe2().");
+    }
+}
+
+void protectedDup2(int oldFd, int newFd) {
+    if(dup2(oldFd, newFd) < 0) {
+        unix_error("Error calling dup2().");
+    }
+}
+
+/*
+ * openRedirect - Open the file for a < or > redirect in the shell itself,
+ *    so both launch paths only have to dup2 it. Returns -1 on error.
+ */
+int openRedirect(char *filename, int flags) {
+    int fileFd;
+    if((fileFd = open(filename, flags | O_CLOEXEC, 0644)) < 0) {
+        outf("%s: %s\n", filename, strerror(errno));
+    }
+    return fileFd;
+}
+
+/*
+ * forkStage - Launch one pipeline stage (path, run as argv) with fork and execve. The child
+ *    joins process group pgid (0 for a new group), installs signal mask
+ *    mask, and takes inFd/outFd as its stdin/stdout.
+ */
+pid_t forkStage(char *path, char **argv, pid_t pgid, int inFd, int outFd, sigset_t *mask) {
+    pid_t pid;
+
+    // Child
+    if((pid = protectedFork()) == 0) {
+        //before the execve, the child process should call
+        // setpgid(0, 0), which puts the child in a new process group whose group ID is identical to the
+        // child’s PID. This ensures that there will be only one process, your shell, in the foreground process
+        // group. Later stages join the first stage's group so the whole
+        // pipeline gets ctrl-c/ctrl-z together.
+        protectedSetpgid(0, pgid);
+
+        // Unblock SIGCHLD signals, again using sigprocmask after it adds the child
+        protectedSigprocmask(SIG_SETMASK, mask, NULL);
+
+        if(inFd != STDIN_FILENO) {
+            protectedDup2(inFd, STDIN_FILENO);
+        }
+        if(outFd != STDOUT_FILENO) {
+            protectedDup2(outFd, STDOUT_FILENO);
+        }
+
+        // Attempt to execute the program
+        traceevent(TR_EXEC, getpid(), 0, 0);
+        if (execve(path, argv, environ) < 0) {
+                printf("%s: Command not found\n", argv[0]);
+                exit(0); // Exit the child process
+        }
+    }
+
+    // Parent also sets the group so it exists before the next stage
+    // tries to join it. This fails harmlessly if the child already exec'd.
+    // (An execve failure happens in the child, where we can't count it.)
+    setpgid(pid, pgid ? pgid : pid);
+    stats.launches++;
+    traceevent(TR_LAUNCH, pid, 0, pgid ? pgid : pid);
+    return pid;
+}
+
+/*
+ * spawnStage - Launch one pipeline stage with posix_spawn. Same contract
+ *    as forkStage, but glibc runs the child on the shell's memory with
+ *    clone(CLONE_VM|CLONE_VFORK), so no page tables get copied. The
+ *    setpgid, sigprocmask and dup2 steps become spawn attributes and file
+ *    actions. Returns 0 if the program couldn't be started.
+ */
+pid_t spawnStage(char *path, char **argv, pid_t pgid, int inFd, int outFd, sigset_t *mask) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err;
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, mask);
+
+    posix_spawn_file_actions_init(&actions);
+    if(inFd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+    }
+    if(outFd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+    }
+
+    err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+
+    // A cached path that has gone away: forget it, search PATH again, retry once
+    if(err == ENOENT && path != argv[0]) {
+        forgetcommand(argv[0]);
+        if((path = findcommand(argv[0])) != NULL) {
+            err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if(err != 0) {
+        stats.execfails++;
+        outf("%s: Command not found\n", argv[0]);
+        return 0;
+    }
+    stats.launches++;
+    traceevent(TR_LAUNCH, pid, 0, pgid ? pgid : pid);
+    traceevent(TR_EXEC, pid, 0, 0); // posix_spawn returns after the exec
+    return pid;
+}
+
 /*
  * Signal - wrapper for the sigaction function
  */
@@ -350,11 +802,15 @@ handler_t *Signal(int signum, handler_t *handler) {
 
 /*
  * sigquit_handler - The driver program can gracefully terminate the
- *    child shell by sending it a SIGQUIT signal.
+ *    child shell by sending it a SIGQUIT signal. The output ring is left
+ *    alone, since the main loop may be in the middle of draining it;
+ *    it is empty anyway while the shell waits for input.
  */
 void sigquit_handler(int sig) {
-    printf("Terminating after receipt of SIGQUIT signal\n");
-    exit(1);
+    static const char msg[] = "Terminating after receipt of SIGQUIT signal\n";
+
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    _exit(1);
 }
 
 /* 
@@ -365,13 +821,13 @@ void do_bgfg(char **argv) {
     
     // If the user doesn't specify a PID or JID
     if(argv[1] == NULL) {
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        outf("%s command requires PID or %%jobid argument\n", argv[0]);
         return;
     }
 
     // If the second argument isn't a number
     if(argv[1][0] != '%' && !isdigit(argv[1][0])) {
-        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+        outf("%s: argument must be a PID or %%jobid\n", argv[0]);
         return;
     }
 
@@ -386,25 +842,25 @@ void do_bgfg(char **argv) {
     if(!isPid) { // See if the jid exists
         theJob = getjobjid(jobs, (pid_t) atoi(&argv[1][1]));
         if(theJob == NULL) {
-            //printf("(%d): No such job\n", (pid_t) atoi(&argv[1][1]));
-            printf("%s: No such job\n", argv[1]);
+            //outf("(%d): No such job\n", (pid_t) atoi(&argv[1][1]));
+            outf("%s: No such job\n", argv[1]);
             return;
         }        
     } else { // See if the pid exists
         theJob = getjobpid(jobs, (pid_t) atoi(argv[1]));
         if(theJob == NULL) {
-            printf("(%d): No such process\n", (pid_t) atoi(argv[1]));
+            outf("(%d): No such process\n", (pid_t) atoi(argv[1]));
             return;
         }
     }
     
     if(strcmp(argv[0], "bg") == 0) { // They requested bg
-        theJob->state = BG; // Assign it to the background state
-        printf("[%d] (%d) %s", theJob->jid, theJob->pid, theJob->cmdline);
-        protectedKill(-theJob->pid, SIGCONT); // Give a SIGCONT signal to theJob's process group
+        setjobstate(theJob, BG); // Assign it to the background state
+        outf("[%d] (%d) %s", theJob->jid, theJob->pid, jobcmdline(theJob));
+        protectedSignalJob(theJob, SIGCONT); // Give a SIGCONT signal to theJob's process group
     } else { // They requested fg
-        theJob->state = FG; // Assign it to the foreground state
-        protectedKill(-theJob->pid, SIGCONT); // Give a SIGCONT signal to theJob's process group
+        setjobstate(theJob, FG); // Assign it to the foreground state
+        protectedSignalJob(theJob, SIGCONT); // Give a SIGCONT signal to theJob's process group
         waitfg(theJob->pid); // Wait because the slides told me to ;)
     }
     return;
@@ -415,17 +871,61 @@ void do_bgfg(char **argv) {
  * 20 lines
  */
 void waitfg(pid_t pid) {
-    // – In waitfg, use a busy loop around the sleep function.
-    
-    while(1) {
-        // fgpid(jobs) returns the pid of the current foreground job, 
-        // or 0 if there isn't a foreground job
-        if(pid != fgpid(jobs)) {
-            break; // We are done waiting.
-        } else {
-            sleep(1);
+    // In event mode the signals are already blocked and arrive on the
+    // signalfd, so just run the event loop until the job leaves the foreground.
+    if(useevents) {
+        while(pid == fgpid(jobs)) {
+            handleevents(-1);
+            stats.fgwakeups++;
+        }
+        return;
+    }
+
+    // Block SIGCHLD while we look at the job list so the child can't be
+    // reaped between draining the child ring and going to sleep. sigsuspend
+    // then atomically restores the old mask and sleeps until a handler has
+    // run, so we wake up as soon as sigchld_handler queues a wait status.
+    sigset_t mask, prev_mask;
+    protectedSigemptyset(&mask);
+    protectedSigaddset(&mask, SIGCHLD);
+    protectedSigprocmask(SIG_BLOCK, &mask, &prev_mask);
+
+    // fgpid(jobs) returns the pid of the current foreground job, 
+    // or 0 if there isn't a foreground job
+    drainchld();
+    while(pid == fgpid(jobs)) {
+        sigsuspend(&prev_mask); // Always returns -1 with errno == EINTR
+        stats.fgwakeups++;
+        drainchld(); // Apply what the handler queued
+    }
+
+    protectedSigprocmask(SIG_SETMASK, &prev_mask, NULL);
+}
+
+/*
+ * waitbg - Block until fewer than limit background jobs are running
+ */
+void waitbg(int limit) {
+    if(useevents) {
+        while(nbgjobs >= limit) {
+            handleevents(-1);
         }
+        return;
+    }
+
+    // Same lost-wakeup dance as waitfg
+    sigset_t mask, prev_mask;
+    protectedSigemptyset(&mask);
+    protectedSigaddset(&mask, SIGCHLD);
+    protectedSigprocmask(SIG_BLOCK, &mask, &prev_mask);
+
+    drainchld();
+    while(nbgjobs >= limit) {
+        sigsuspend(&prev_mask);
+        drainchld();
     }
+
+    protectedSigprocmask(SIG_SETMASK, &prev_mask, NULL);
 }
 
 /********************************************************************
@@ -437,68 +937,209 @@ void waitfg(pid_t pid) {
  *     a child job terminates (becomes a zombie), or stops because it
  *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
  *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ *     currently running children to terminate. It leaves the job list
+ *     alone: each wait status goes into the child ring, and drainchld
+ *     applies them from the main loop.
  * 80 lines
  */
 void sigchld_handler(int sig) {
-
-    // Reap the child process using waitpid
-
+    int olderrno = errno; // wait4 leaves ECHILD behind
+    unsigned int tail = chldtail;
+    unsigned long reaped = 0;
+    struct chldevent_t *ev;
     pid_t pid;
-    int status;
 
     // Since there may be more than one child process waiting to be reaped when sigchld_handler()
     // is called, you need to call waitpid() in a loop until it returns something less than 0. 
-    // By reaping and deleting jobs in a loop, you ensure that all zombie processes are reaped
+    // By reaping in a loop, you ensure that all zombie processes are reaped
     // and no jobs are left unaccounted for.
-    while((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) { // Returns a pid
-
-        int jobId = pid2jid(pid); // Needed for future functionality?
+    while(1) {
+        // Only reap what there is room to queue. The rest stay zombies
+        // until drainchld has made room and raised SIGCHLD again.
+        if(tail - __atomic_load_n(&chldhead, __ATOMIC_ACQUIRE) == CHLDRING) {
+            chldfull = 1;
+            break;
+        }
+        ev = &chldring[tail & (CHLDRING - 1)];
 
         //********waitpid() explanation below**************//
         // pid - 1 means you want to wait for any child (effectively making waitpid() behave like wait())
         // WNOHANG means waitpid will return immediately instead of blocking
         // and WUNTRACED means stopped processes will be reaped
         // Waitpid returns 0 if no children have terminated, or with the PID of one of the terminated children.
-
-        // WIFEXITED returns true if the child terminated normally
-        if(WIFEXITED(status)) {
-            deletejob(jobs, pid);   
-            if (verbose) printf("sigchld_handler: jobId %d, pid %d, deleted.\n", jobId, pid);
-            if (verbose) printf("sigchld_handler: jobId %d, pid %d, terminated normally. Exit status: %d.\n", jobId, pid, WEXITSTATUS(status));
+        // wait4 is waitpid plus the child's rusage, which goes into the job's accounting.
+        if((pid = wait4(-1, &ev->status, WNOHANG | WUNTRACED, &ev->ru)) <= 0) {
+            break;
         }
+        ev->pid = pid;
+        ev->ns = nowns();
+        __atomic_store_n(&chldtail, ++tail, __ATOMIC_RELEASE); // Publish it
+        reaped++;
+    }
 
-        // WIFSIGNALED returns true if the child process was terminated by a signal (like SIGINT if they 
-        // hit us up with ctrl-c.
-        if(WIFSIGNALED(status)) {
-            deletejob(jobs, pid);
-            if (verbose) printf("sigchld_handler: jobId %d, pid %d, deleted.\n", jobId, pid);
-            printf("Job [%d] (%d) terminated by signal %d\n", jobId, (int) pid, WTERMSIG(status));
+    if(!useevents) {
+        stats.sigchlds++; // In event mode handlesignals counts the deliveries
+    }
+    stats.reapruns++;
+    if(reaped > stats.maxreaps) {
+        stats.maxreaps = reaped;
+    }
+    errno = olderrno;
+}
+
+/*
+ * drainchld - Apply every wait status sigchld_handler has queued to the
+ *    job list, in the order they were reaped. Main loop only: call it
+ *    before looking at job states. A queued PID is free for the kernel
+ *    to reuse, so eval drains with SIGCHLD blocked before launching a
+ *    job, and keeps it blocked until addjob.
+ */
+void drainchld(void) {
+    unsigned int head = chldhead;
+    struct chldevent_t *ev;
+
+    while(head != __atomic_load_n(&chldtail, __ATOMIC_ACQUIRE)) {
+        ev = &chldring[head & (CHLDRING - 1)];
+        reapchild(ev->pid, ev->status, WIFSTOPPED(ev->status) ? NULL : &ev->ru, ev->ns);
+        __atomic_store_n(&chldhead, ++head, __ATOMIC_RELEASE); // Hand the slot back
+    }
+
+    // The handler left zombies behind for want of room; have it try again
+    if(chldfull) {
+        chldfull = 0;
+        raise(SIGCHLD);
+    }
+}
+
+/*
+ * reapchild - Update the job list for one child that waitpid reported
+ *    with status at time ns: it exited, was killed, or stopped. ru is
+ *    its rusage if it was reaped, NULL for a stop. Only that process's
+ *    state changes; the job's follows from the states of all of them.
+ */
+void reapchild(pid_t pid, int status, struct rusage *ru, long long ns) {
+    int j;
+
+    // A pipeline job has one entry for all of its processes; the pid index
+    // says which job, and which stage of it, this pid is.
+    struct job_t *job = getjobproc(jobs, pid, &j);
+    stats.reaps++;
+    if(job == NULL) {
+        return; // Not one of ours (or already cleaned up)
+    }
+    int jobId = job->jid;
+
+    if(WIFSTOPPED(status)) {
+        traceevent(TR_STOP, pid, jobId, WSTOPSIG(status));
+    } else {
+        traceevent(TR_REAP, pid, jobId, status);
+    }
+
+    // The time keyword wants to know when the first SIGCHLD for its job landed
+    if(job->pid == timed.pid && timed.firstchld == 0) {
+        timed.firstchld = ns;
+    }
+
+    // WIFSTOPPPED returns true if the child process was stopped by delivery of a signal.
+    // The job only counts as stopped once none of its processes is left running.
+    if(WIFSTOPPED(status)) {
+        if(jobprocs(job)[j].state == PS_RUN) {
+            jobprocs(job)[j].state = PS_STOP;
+            job->nstopped++;
         }
+        job->stopsig = WSTOPSIG(status);
+        if(job->nstopped == job->nlive) {
+            stopjob(job);
+        }
+        return;
+    }
+
+    // Otherwise it exited or was killed: it is gone for good, and so is
+    // its claim on the PID
+    procdone(job, j);
 
-        // WIFSTOPPPED returns true if the child process was stopped by delivery of a signal. (like if
-        // a child were terminated)
-        if(WIFSTOPPED(status)) {
-            // change job's tracked state from FG to ST
-            getjobpid(jobs, pid)->state = ST;
-            printf("Job [%d] (%d) stopped by signal %d\n", jobId, (int) pid, WSTOPSIG(status));
+    // Charge what the process used to its job
+    if(ru != NULL) {
+        job->usage.utime += ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+        job->usage.stime += ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+        if(ru->ru_maxrss > job->usage.maxrss) {
+            job->usage.maxrss = ru->ru_maxrss;
         }
-        
+        job->usage.nvcsw += ru->ru_nvcsw;
+        job->usage.nivcsw += ru->ru_nivcsw;
     }
 
-    // (PDF)
-    // get the job associated with the terminated process' pid
-    // delete job from jobs table
-    // Back to the input loop (aka return)
+    // Like any shell, a pipeline's exit status is its last stage's
+    if(j == job->nprocs - 1) {
+        job->status = status;
+    }
 
-    // (PDF) -- if triggered by the SIGSTP handler
-    // get the job associated with the terminated process' pid
-    // print result to console
-    // Back to the input loop (aka return)
+    // WIFEXITED returns true if the child terminated normally
+    if (verbose && WIFEXITED(status)) outf("sigchld_handler: jobId %d, pid %d, terminated normally. Exit status: %d.\n", jobId, pid, WEXITSTATUS(status));
+
+    // The job is finished once every stage of the pipeline has been reaped.
+    if(job->nlive == 0) {
+        pid_t jobPid = job->pid;
+        status = job->status;
+
+        // Keep the par builtin's tally
+        if(job->par) {
+            parlive--;
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                parfailed++;
+            }
+        }
+
+        // Fold the finished job into the totals that times reports
+        doneusage.utime += job->usage.utime;
+        doneusage.stime += job->usage.stime;
+        doneusage.wall += ns - job->started;
+        if(job->usage.maxrss > doneusage.maxrss) {
+            doneusage.maxrss = job->usage.maxrss;
+        }
+        doneusage.nvcsw += job->usage.nvcsw;
+        doneusage.nivcsw += job->usage.nivcsw;
+        donejobs++;
+
+        if(jobPid == timed.pid) {
+            timed.reaped = ns;
+            timed.usage = job->usage;
+            timed.pid = 0;
+        }
+
+        removejob(job);
+        if (verbose) outf("sigchld_handler: jobId %d, pid %d, deleted.\n", jobId, jobPid);
+        // WIFSIGNALED returns true if the last stage was terminated by a signal (like SIGINT if they 
+        // hit us up with ctrl-c.
+        if (WIFSIGNALED(status)) outf("Job [%d] (%d) terminated by signal %d\n", jobId, (int) jobPid, WTERMSIG(status));
+    } else if(job->nstopped == job->nlive) {
+        // The last running stage exited while the rest are stopped
+        stopjob(job);
+    }
+}
+
+/*
+ * stopjob - Every live process of job has stopped: move the job to ST
+ *    and report it, once
+ */
+void stopjob(struct job_t *job) {
+    if(job->state == ST) {
+        return;
+    }
+    // change job's tracked state from FG to ST
+    setjobstate(job, ST);
+    outf("Job [%d] (%d) stopped by signal %d\n", job->jid, (int) job->pid, job->stopsig);
 
-    // (SLIDES)
-    // reap the child process using waitpid();
+    // A stopped job is no longer timed; fg later would time the wait, not the job
+    if(job->pid == timed.pid) {
+        timed.pid = 0;
+    }
 
+    // A stopped par job becomes an ordinary job the user can fg/bg later
+    if(job->par) {
+        job->par = 0;
+        parlive--;
+    }
 }
 
 /* 
@@ -508,12 +1149,15 @@ void sigchld_handler(int sig) {
  * 15 lines
  */
 void sigint_handler(int sig) {
-    // get the foreground job
-    pid_t foregroundPid = fgpid(jobs);
+    // get the foreground job, by slot rather than PID: a pipeline's first
+    // stage may be reaped, and gone from the pid index, while the rest run
+    struct job_t *job = fgslot >= 0 ? &jobs[fgslot] : NULL;
 
-    if(foregroundPid != 0) { // Don't do anything if we are inside of the child?
+    if(job != NULL && job->nlive > 0) { // Not a job that is being deleted
         // terminate foreground job (and all processes in the same process group)
-        protectedKill(-foregroundPid, sig);
+        protectedSignalJob(job, sig);
+    } else if(job == NULL && parlive > 0) { // par is running: its jobs are the foreground
+        signalpar(sig);
     }
 
     
@@ -532,12 +1176,15 @@ void sigint_handler(int sig) {
  */
 void sigtstp_handler(int sig) {
 
-    // get the foreground job
-    pid_t foregroundPid = fgpid(jobs);
+    // get the foreground job, by slot rather than PID: a pipeline's first
+    // stage may be reaped, and gone from the pid index, while the rest run
+    struct job_t *job = fgslot >= 0 ? &jobs[fgslot] : NULL;
 
-    if(foregroundPid != 0) { // Don't do anything if we are inside of the child?
+    if(job != NULL && job->nlive > 0) { // Not a job that is being deleted
         // terminate foreground job (and all processes in the same process group)
-        protectedKill(-foregroundPid, sig);
+        protectedSignalJob(job, sig);
+    } else if(job == NULL && parlive > 0) { // par is running: its jobs are the foreground
+        signalpar(sig);
     }
 
     // (PDF) -- If triggered by SIGINT
@@ -562,70 +1209,207 @@ void sigtstp_handler(int sig) {
 void eval(char *cmdline) 
 {
     //################### Variables ######################//
-    char *argv[MAXLINE];    // Using MAXLINE instead of MAXARGS because this will contain 
-                            // both arguments and commands.
-    char arguments[100];    // Will contain the arguments from the commandline.
-    strcpy(arguments, cmdline);
-    
-    int isBackgroundJob; // Will be 1 if user has requesteed a background job
-                          // Will be 0 if user has requested a foreground job
-    isBackgroundJob = parseline(arguments, argv);  // Will be 1 if user has requested a BG job
-                                                   // Will be 0 if user has requested a FG job
-
-    if(!builtin_cmd(argv)) {  
-
-        pid_t pid = 0;
-
-        // The parent must use sigprocmask to block SIGCHLD signals before it forks the child
-        sigset_t mask;
-        protectedSigemptyset(&mask);          // init vector to zeros
-        protectedSigaddset(&mask, SIGCHLD); // set the SIGCHLD bit in the vector
-        protectedSigprocmask(SIG_BLOCK, &mask, NULL); // Block the sigchild bit in the vector
-
-        // Child
-        if((pid = protectedFork()) == 0) {
-            //before the execve, the child process should call
-            // setpgid(0, 0), which puts the child in a new process group whose group ID is identical to the
-            // child’s PID. This ensures that there will be only one process, your shell, in the foreground process
-            // group.
-            protectedSetpgid(0,0);
-            
-            // Unblock SIGCHLD signals, again using sigprocmask after it adds the child
-            protectedSigprocmask(SIG_UNBLOCK, &mask, NULL); // Unblock the sigchild bit in the vector
-
-            // Attempt to execute the program
-            if (execve(argv[0], argv, environ) < 0) {
-                    printf("%s: Command not found\n", argv[0]);
-                    exit(0); // Exit the child process
+    // Split the line into stages; each one can be handed to execve as its
+    // own argv. It all lives in cmdarena, which the caller resets.
+    long long start = nowns();
+    struct cmdline_t *cl = parsecmdline(cmdline, &cmdarena);
+    long long parsed = nowns();
+    if(cl == NULL) {
+        outf("Syntax error\n");
+        return;
+    }
+    if(cl->ncmds == 0) {
+        return; // Ignore blank lines
+    }
+    stats.evals++;
+    int numCmds = cl->ncmds;
+    int isBackgroundJob = cl->bg; // Will be 1 if user has requested a BG job
+                                  // Will be 0 if user has requested a FG job
+
+    // "time cmd args" times the rest of the line. Only foreground jobs:
+    // the report comes out when the shell gets the terminal back.
+    int timing = 0;
+    if(!strcmp(cl->stages->argv[0], "time")) {
+        if(cl->stages->argv[1] == NULL || isBackgroundJob) {
+            outf("usage: time command [args] (foreground only)\n");
+            return;
+        }
+        cl->stages->argv++;
+        timing = 1;
+        memset(&timed, 0, sizeof(timed));
+        timed.start = start;
+        timed.parsed = parsed;
+    }
+
+    // A builtin runs in the shell, so time it with the shell's own usage
+    struct rusage before, after;
+    if(timing) {
+        getrusage(RUSAGE_SELF, &before);
+        timed.spawned = nowns();
+    }
+
+    if(builtin_cmd(cl->stages->argv)) {
+        if(timing) {
+            timed.firstchld = nowns();
+            timed.reaped = timed.firstchld;
+            getrusage(RUSAGE_SELF, &after);
+            timed.usage.utime = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000LL
+                                + after.ru_utime.tv_usec - before.ru_utime.tv_usec;
+            timed.usage.stime = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000LL
+                                + after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+            timereport(&timed.usage, timed.reaped);
+        }
+    } else {
+
+        pid_t pids[MAXPROCS];
+        pid_t pgid = 0;           // Process group of the job, set by its first process
+        int numProcs = 0;         // Stages that actually started
+        int inFd = STDIN_FILENO;  // Read end of the pipe feeding the next stage
+        int pipeFds[2];
+        struct stage_t *stage;
+
+        if(numCmds > MAXPROCS) {
+            outf("Too many commands in pipeline\n");
+            return;
+        }
+
+        // With -j, a background job waits here for a free slot
+        if(isBackgroundJob && maxbgjobs > 0) {
+            waitbg(maxbgjobs);
+        }
+
+        // Batched output still has to go out before a foreground job can
+        // write after it, and before fork copies the buffer into a child.
+        if(batchout && (usefork || !isBackgroundJob)) {
+            outflush();
+        }
+
+        // Block SIGCHLD, then apply the statuses already queued, and keep it
+        // blocked until addjob. Then nothing is reaped while we launch:
+        // every PID the job list still holds belongs to a live process or
+        // a zombie, so the kernel can't hand one of them to a new stage,
+        // and a pipeline's first stage stays around (if only as a zombie)
+        // for the later stages to join its process group.
+        // (In event mode SIGCHLD is always blocked, and nothing is reaped
+        // outside handleevents, so there is nothing to do.)
+        sigset_t mask, prev_mask;
+        protectedSigemptyset(&mask);
+        protectedSigaddset(&mask, SIGCHLD);
+        if(!useevents) {
+            protectedSigprocmask(SIG_BLOCK, &mask, &prev_mask);
+        }
+        drainchld();
+
+        for(stage = cl->stages; stage != NULL; stage = stage->next) {
+            int outFd = STDOUT_FILENO;
+            int stageIn, stageOut;
+            pid_t pid = 0;
+
+            // Every stage but the last writes into a fresh pipe. Both ends are
+            // close-on-exec, so the only copies a child keeps are the ones it
+            // dup2s onto stdin/stdout.
+            if(stage->next != NULL) {
+                protectedPipe2(pipeFds, O_CLOEXEC);
+                outFd = pipeFds[1];
+            }
+
+            // Explicit redirects override the pipes
+            stageIn = inFd;
+            stageOut = outFd;
+            if(stage->infile != NULL) {
+                stageIn = openRedirect(stage->infile, O_RDONLY);
+            }
+            if(stage->outfile != NULL && stageIn >= 0) {
+                stageOut = openRedirect(stage->outfile, O_WRONLY | O_CREAT | O_TRUNC);
+            }
+
+            char *path = findcommand(stage->argv[0]);
+            if(path == NULL) {
+                stats.execfails++;
+                outf("%s: Command not found\n", stage->argv[0]);
+            } else if(stageIn >= 0 && stageOut >= 0) {
+                if(usefork) {
+                    pid = forkStage(path, stage->argv, pgid, stageIn, stageOut, &childmask);
+                } else {
+                    pid = spawnStage(path, stage->argv, pgid, stageIn, stageOut, &childmask);
+                }
+            }
+            if(pid > 0) {
+                if(pgid == 0) {
+                    pgid = pid;
+                }
+                pids[numProcs++] = pid;
+            }
+
+            // The parent doesn't use the pipes or redirect files itself; drop
+            // its copies so the readers see EOF once the writers exit.
+            if(stageIn >= 0 && stageIn != inFd) {
+                close(stageIn);
+            }
+            if(stageOut >= 0 && stageOut != outFd) {
+                close(stageOut);
+            }
+            if(inFd != STDIN_FILENO) {
+                close(inFd);
+            }
+            if(stage->next != NULL) {
+                close(pipeFds[1]);
+                inFd = pipeFds[0];
+            }
+        }
+
+        if(timing) {
+            timed.spawned = nowns();
+        }
+
+        if(numProcs == 0) { // Nothing started, so there is no job
+            if(!useevents) {
+                protectedSigprocmask(SIG_SETMASK, &prev_mask, NULL);
             }
+            return;
+        }
+
+        // Only now is there a pids[0] for the time keyword to watch
+        if(timing) {
+            timed.pid = pids[0];
+        }
 
+        // Keep ctrl-c and ctrl-z out too until addjob has the job in place,
+        // so their handlers never see it half built
+        if(!useevents) {
+            protectedSigaddset(&mask, SIGINT);
+            protectedSigaddset(&mask, SIGTSTP);
+            protectedSigprocmask(SIG_BLOCK, &mask, NULL);
         }
 
         // Parent
         if(isBackgroundJob) { // Background job
             // Add job to list
-            addjob(jobs, pid, BG, cmdline);
-            protectedSigprocmask(SIG_UNBLOCK, &mask, NULL);
-            printf("[%d] (%d) %s\n", pid2jid(pid), (int)pid, cmdline);               
-            // unblock the blocked SIGCHLD signals using sigprocmask after 
-            // it adds the child to the job list by calling addjob.
+            addjob(jobs, pids, numProcs, BG, cmdline);
+            if(!useevents) {
+                protectedSigprocmask(SIG_SETMASK, &prev_mask, NULL);
+            }
+            outf("[%d] (%d) %s\n", pid2jid(pids[0]), (int)pids[0], cmdline);               
         } else { // Foreground
             // Add job to list
-            addjob(jobs, pid, FG, cmdline);
-            protectedSigprocmask(SIG_UNBLOCK, &mask, NULL);
-            waitfg(pid); // Wait on the foreground process
+            addjob(jobs, pids, numProcs, FG, cmdline);
+            if(!useevents) {
+                protectedSigprocmask(SIG_SETMASK, &prev_mask, NULL);
+            }
+            waitfg(pids[0]); // Wait on the foreground process
+            if(timing && timed.reaped != 0) {
+                timereport(&timed.usage, timed.reaped);
+            }
+            timed.pid = 0;
         }        
     }      
 
 
 
-    // In eval, the parent must use sigprocmask to block SIGCHLD signals before it forks the child,
-    // and then unblock these signals, again using sigprocmask after it adds the child to the job list by
-    // calling addjob. Since children inherit the blocked vectors of their parents, the child must be sure
-    // to then unblock SIGCHLD signals before it execs the new program.
-    // The parent needs to block the SIGCHLD signals in this way in order to avoid the race condition where
-    // the child is reaped by sigchld handler (and thus removed from the job list) before the parent
-    // calls addjob.
+    // The handout had eval block SIGCHLD from fork until addjob, so the handler couldn't
+    // reap the child (and remove it from the job list) before the parent added it. The
+    // handler no longer touches the job list, but the block stays: it is what keeps
+    // PIDs from being reused, and pipeline process groups alive, until addjob.
 
     // After the fork, but before the execve, the child process should call
     // setpgid(0, 0), which puts the child in a new process group whose group ID is identical to the
@@ -643,7 +1427,7 @@ void eval(char *cmdline)
 int builtin_cmd(char **argv) 
 {
     if(!strcmp(argv[0], "quit")) { // If firstCommand == "quit"
-        exit(0);
+        quitshell();
     }
     if(!strcmp(argv[0], "fg")) { // If firstCommand == "fg"
         do_bgfg(argv);
@@ -654,7 +1438,27 @@ int builtin_cmd(char **argv)
         return 1;
     }
     if(!strcmp(argv[0], "jobs")) { // If firstCommand == "jobs"
-        listjobs(jobs);
+        if(argv[1] != NULL && !strcmp(argv[1], "-l")) {
+            listjobslong(jobs);
+        } else {
+            listjobs(jobs);
+        }
+        return 1;
+    }
+    if(!strcmp(argv[0], "times")) { // If firstCommand == "times"
+        do_times();
+        return 1;
+    }
+    if(!strcmp(argv[0], "stats")) { // If firstCommand == "stats"
+        printstats();
+        return 1;
+    }
+    if(!strcmp(argv[0], "hash")) { // If firstCommand == "hash"
+        do_hash(argv);
+        return 1;
+    }
+    if(!strcmp(argv[0], "par")) { // If firstCommand == "par"
+        do_par(argv);
         return 1;
     }
     return 0;     /* not a builtin command */
@@ -668,124 +1472,596 @@ int builtin_cmd(char **argv)
  * Helper routines that manipulate the job list. These are provided to me.
  **********************************************/
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/* pidhash - Home position of pid in the pid index */
+static unsigned int pidhash(pid_t pid) {
+    return ((unsigned int) pid * 2654435761u) & (pidhashsize - 1);
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+/* 
+ * pidindex_add - Record that process pid is process member of the job
+ *    in slot. A stale entry for the same PID is taken over: the process
+ *    being added is the one that has it now.
+ */
+static void pidindex_add(pid_t pid, int slot, int member) {
+    unsigned int i = pidhash(pid);
+
+    while (pidindex[i].pid != 0 && pidindex[i].pid != pid)
+	i = (i + 1) & (pidhashsize - 1);
+    if (pidindex[i].pid == 0)
+	pidcount++;
+    pidindex[i].pid = pid;
+    pidindex[i].slot = slot;
+    pidindex[i].member = member;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
-{
-    int i, max=0;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+/* 
+ * pidindex_find - Return the slot of the job owning pid, -1 if none,
+ *    and pid's index in that job's jobprocs() in *member
+ */
+static int pidindex_find(pid_t pid, int *member) {
+    unsigned int i = pidhash(pid);
+
+    while (pidindex[i].pid != 0) {
+	if (pidindex[i].pid == pid) {
+	    *member = pidindex[i].member;
+	    return pidindex[i].slot;
+	}
+	i = (i + 1) & (pidhashsize - 1);
+    }
+    return -1;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
-{
-    int i;
-    
-    if (pid < 1)
+/* 
+ * pidindex_remove - Drop pid from the pid index, unless a job other
+ *    than the one in slot has taken it over since. Later entries in the
+ *    same probe run are shifted back so lookups never need tombstones.
+ */
+static void pidindex_remove(pid_t pid, int slot) {
+    unsigned int i = pidhash(pid), j, home;
+
+    while (pidindex[i].pid != pid) {
+	if (pidindex[i].pid == 0)
+	    return;
+	i = (i + 1) & (pidhashsize - 1);
+    }
+    if (pidindex[i].slot != slot)
+	return;
+    j = i;
+    while (1) {
+	j = (j + 1) & (pidhashsize - 1);
+	if (pidindex[j].pid == 0)
+	    break;
+	home = pidhash(pidindex[j].pid);
+	/* Move j into the hole at i unless its home lies in (i, j] */
+	if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+	    pidindex[i] = pidindex[j];
+	    i = j;
+	}
+    }
+    pidindex[i].pid = 0;
+    pidcount--;
+}
+
+/* 
+ * blockjobsignals - Block every signal whose handler touches the job
+ *    list, saving the old mask in prev_mask
+ */
+static void blockjobsignals(sigset_t *prev_mask) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, prev_mask);
+    stats.sigprocmasks += 2; /* counting the restore that goes with it */
+}
+
+/* 
+ * growpids - Make room for n more PIDs in the pid index, rehashing into
+ *    a table twice the size whenever it would become over half full.
+ *    Returns 0 if memory ran out.
+ */
+static int growpids(unsigned int n) {
+    struct pidslot_t *old = pidindex, *new;
+    unsigned int oldsize = pidhashsize, size = pidhashsize, i;
+    sigset_t prev_mask;
+
+    while ((pidcount + n) * 2 > size)
+	size *= 2;
+    if (size == oldsize)
+	return 1;
+    if ((new = calloc(size, sizeof(struct pidslot_t))) == NULL)
 	return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+    blockjobsignals(&prev_mask);
+    pidindex = new;
+    pidhashsize = size;
+    pidcount = 0;
+    for (i = 0; i < oldsize; i++)
+	if (old[i].pid != 0)
+	    pidindex_add(old[i].pid, old[i].slot, old[i].member);
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    free(old);
+    return 1;
+}
+
+/* 
+ * growjids - Make sure jid has an entry in the JID index. Returns 0 if
+ *    memory ran out.
+ */
+static int growjids(int jid) {
+    int *new, cap = jidcap, i;
+    sigset_t prev_mask;
+
+    if (jid < jidcap)
+	return 1;
+    while (cap <= jid)
+	cap *= 2;
+    blockjobsignals(&prev_mask);
+    if ((new = realloc(jidindex, cap * sizeof(int))) != NULL) {
+	for (i = jidcap; i < cap; i++)
+	    new[i] = -1;
+	jidindex = new;
+	jidcap = cap;
+    }
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return new != NULL;
+}
+
+/* 
+ * growjobs - Double the job list and thread the new slots onto the free
+ *    list. Returns the (possibly moved) job list, or NULL if memory ran out.
+ */
+static struct job_t *growjobs(void) {
+    struct job_t *newjobs;
+    int newmax = maxjobs ? maxjobs * 2 : MAXJOBS, i;
+    sigset_t prev_mask;
+
+    blockjobsignals(&prev_mask);
+    if ((newjobs = realloc(jobs, newmax * sizeof(struct job_t))) == NULL) {
+	sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+	return NULL;
+    }
+    jobs = newjobs;
+    for (i = newmax - 1; i >= maxjobs; i--) {
+	clearjob(&jobs[i]);
+	jobs[i].nextfree = freejob;
+	freejob = i;
+    }
+    maxjobs = newmax;
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return jobs;
+}
+
+/* 
+ * growprocs - Double the pipeline process pool and put the new blocks
+ *    on its free list. Returns 0 if memory ran out.
+ */
+static int growprocs(void) {
+    struct proc_t *new;
+    int newblocks = procblocks ? procblocks * 2 : 4, i;
+    sigset_t prev_mask;
+
+    blockjobsignals(&prev_mask);
+    if ((new = realloc(procpool, newblocks * MAXPROCS * sizeof(struct proc_t))) == NULL) {
+	sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+	return 0;
+    }
+    procpool = new;
+    for (i = procblocks * MAXPROCS; i < newblocks * MAXPROCS; i++) {
+	procpool[i].pid = 0;
+	procpool[i].pidfd = -1;
+	procpool[i].state = PS_DONE;
+    }
+    for (i = newblocks - 1; i >= procblocks; i--) {
+	procpool[i * MAXPROCS].pid = freeprocs;
+	freeprocs = i * MAXPROCS;
+    }
+    procblocks = newblocks;
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return 1;
+}
+
+static unsigned int cmdhash(char *name);
+
+/* cmdstrsize - Bytes a pool entry for len bytes of text takes up */
+static unsigned int cmdstrsize(unsigned int len) {
+    return (sizeof(struct cmdstr_t) + len + 1 + 7) & ~7U;
+}
+
+/* 
+ * compactcmds - Slide the live pool entries down over the garbage ones,
+ *    point the jobs at the new offsets, and rebuild the hash buckets
+ */
+static void compactcmds(void) {
+    struct cmdstr_t *e;
+    unsigned int off, to, size;
+    int i;
+
+    /* Work out where each live entry goes, parking it in its next field */
+    for (off = to = 8; off < cmdpoolused; off += size) {
+	e = (struct cmdstr_t *) (cmdpool + off);
+	size = cmdstrsize(e->len);
+	if (e->refs > 0) {
+	    e->next = to;
+	    to += size;
+	}
+    }
+    for (i = 0; i < maxjobs; i++)
+	if (jobs[i].cmdoff != 0)
+	    jobs[i].cmdoff = ((struct cmdstr_t *) (cmdpool + jobs[i].cmdoff))->next;
+
+    /* Move them, in order, so nothing is overwritten before it moves */
+    memset(cmdpoolindex, 0, sizeof(cmdpoolindex));
+    for (off = 8; off < cmdpoolused; off += size) {
+	e = (struct cmdstr_t *) (cmdpool + off);
+	size = cmdstrsize(e->len);
+	if (e->refs > 0) {
+	    to = e->next;
+	    memmove(cmdpool + to, e, size);
+	    e = (struct cmdstr_t *) (cmdpool + to);
+	    i = cmdhash(e->text);
+	    e->next = cmdpoolindex[i];
+	    cmdpoolindex[i] = to;
+	}
+    }
+    cmdpoolused -= cmdpooldead;
+    cmdpooldead = 0;
+}
+
+/* 
+ * growcmdpool - Make room for need more bytes in the pool, compacting it
+ *    if that frees enough and doubling it otherwise. Returns 0 if out of
+ *    memory.
+ */
+static int growcmdpool(unsigned int need) {
+    unsigned int newsize = cmdpoolsize ? cmdpoolsize : CMDPOOL;
+    sigset_t prev_mask;
+    char *newpool;
+
+    blockjobsignals(&prev_mask);
+    if (cmdpooldead > 0)
+	compactcmds();
+    if (cmdpoolused + need > cmdpoolsize) {
+	while (cmdpoolused + need > newsize)
+	    newsize *= 2;
+	if ((newpool = realloc(cmdpool, newsize)) == NULL) {
+	    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+	    return 0;
 	}
+	cmdpool = newpool;
+	cmdpoolsize = newsize;
     }
-    printf("Tried to create too many jobs\n");
+    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    return 1;
+}
+
+/* 
+ * cmdintern - Take a reference to the pool entry for text, adding one if
+ *    it isn't there yet. Returns its offset, or 0 if out of memory.
+ *    Called from addjob, in the main loop.
+ */
+static unsigned int cmdintern(char *text) {
+    unsigned int len = strlen(text), h = cmdhash(text), off;
+    struct cmdstr_t *e;
+
+    for (off = cmdpoolindex[h]; off != 0; off = e->next) {
+	e = (struct cmdstr_t *) (cmdpool + off);
+	if (e->len == len && memcmp(e->text, text, len) == 0) {
+	    if (e->refs++ == 0)
+		cmdpooldead -= cmdstrsize(len); /* garbage brought back to life */
+	    return off;
+	}
+    }
+
+    if (cmdpoolused + cmdstrsize(len) > cmdpoolsize && !growcmdpool(cmdstrsize(len)))
+	return 0;
+    off = cmdpoolused;
+    cmdpoolused += cmdstrsize(len);
+    e = (struct cmdstr_t *) (cmdpool + off);
+    e->refs = 1;
+    e->len = len;
+    memcpy(e->text, text, len + 1);
+    e->next = cmdpoolindex[h];
+    cmdpoolindex[h] = off;
+    return off;
+}
+
+/* 
+ * cmdrelease - Drop a job's reference to pool entry off. The entry stays
+ *    findable until the next compaction, so rerunning a command reuses it.
+ */
+static void cmdrelease(unsigned int off) {
+    struct cmdstr_t *e = (struct cmdstr_t *) (cmdpool + off);
+
+    if (off != 0 && --e->refs == 0)
+	cmdpooldead += cmdstrsize(e->len);
+}
+
+/* 
+ * openpidfd - Get a pidfd for job process pid and, in event mode, have
+ *    the event loop watch it. Returns -1 if the kernel can't do pidfds.
+ */
+static int openpidfd(pid_t pid) {
+    struct epoll_event ev;
+    int fd;
+
+    if ((fd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+	pidfdsok = 0;
+	return -1;
+    }
+    if (useevents) {
+	ev.events = EPOLLIN;
+	ev.data.u64 = PIDEVENT | (uint32_t) pid;
+	if (epoll_ctl(jobepfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	    pidfdsok = 0;
+    }
+    return fd;
+}
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->nstopped = 0;
+    job->stopsig = 0;
+    job->status = 0;
+    job->par = 0;
+    job->cmdoff = 0;
+    job->cmdlen = 0;
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->proc.pid = 0;
+    job->proc.pidfd = -1;
+    job->proc.state = PS_DONE;
+    job->procoff = 0;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(void) {
+    pidhashsize = PIDHASH;
+    jidcap = MAXJOBS;
+    pidindex = calloc(pidhashsize, sizeof(struct pidslot_t));
+    jidindex = malloc(jidcap * sizeof(int));
+    cmdpoolused = 8; /* offset 0 means "no entry" */
+    if (pidindex == NULL || jidindex == NULL || growjobs() == NULL ||
+	!growcmdpool(0))
+	unix_error("initjobs error");
+    memset(jidindex, -1, jidcap * sizeof(int));
+    fgslot = -1;
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(void) 
+{
+    int jid;
+
+    /* Walk the JID index, not the (much larger) job entries */
+    for (jid = jidcap - 1; jid > 0; jid--)
+	if (jidindex[jid] >= 0)
+	    return jid;
     return 0;
 }
 
+/* 
+ * addjob - Add a job made of the nprocs processes in pids to the job list.
+ *    Must be called from the main loop: this is where the list grows.
+ */
+int addjob(struct job_t *jobs, pid_t *pids, int nprocs, int state, char *cmdline) 
+{
+    struct proc_t *procs;
+    unsigned int off;
+    int i, j;
+    
+    if (nprocs < 1 || nprocs > MAXPROCS || pids[0] < 1)
+	return 0;
+
+    /* After a wrap, step over JIDs that are still taken */
+    while (nextjid < jidcap && jidindex[nextjid] >= 0)
+	if (++nextjid > MAXJID)
+	    nextjid = 1;
+
+    if ((freejob < 0 && (jobs = growjobs()) == NULL) ||
+	(nprocs > 1 && freeprocs < 0 && !growprocs()) ||
+	!growpids(nprocs) || !growjids(nextjid) ||
+	(off = cmdintern(cmdline)) == 0) {
+	pidfdsok = 0; /* nobody will watch these processes' pidfds */
+	outf("Tried to create too many jobs\n");
+	return 0;
+    }
+
+    /* Pop a slot off the free list */
+    i = freejob;
+    freejob = jobs[i].nextfree;
+
+    jobs[i].pid = pids[0];
+    jobs[i].nprocs = nprocs;
+    jobs[i].nlive = nprocs;
+    if (nprocs > 1) {
+	/* A pipeline: pop a process block too */
+	jobs[i].procoff = freeprocs;
+	freeprocs = procpool[freeprocs].pid;
+    }
+    procs = jobprocs(&jobs[i]);
+    for (j = 0; j < nprocs; j++) {
+	pidindex_add(pids[j], i, j);
+	procs[j].pid = pids[j];
+	procs[j].pidfd = openpidfd(pids[j]);
+	procs[j].state = PS_RUN;
+    }
+    jobs[i].jid = nextjid++;
+    jidindex[jobs[i].jid] = i;
+    if (nextjid > MAXJID)
+	nextjid = 1;
+    jobs[i].started = nowns();
+    if (++stats.jobs > stats.jobshigh)
+	stats.jobshigh = stats.jobs;
+    traceevent(TR_ADDJOB, jobs[i].pid, jobs[i].jid, nprocs);
+    jobs[i].cmdoff = off;
+    jobs[i].cmdlen = ((struct cmdstr_t *) (cmdpool + off))->len;
+
+    /* Last, once the job is whole: for FG this is what hands it to the
+       ctrl-c/ctrl-z handlers */
+    jobs[i].state = UNDEF;
+    setjobstate(&jobs[i], state);
+    if(verbose){
+	outf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobcmdline(&jobs[i]));
+    }
+    return 1;
+}
+
 /* deletejob - Delete a job whose PID=pid from the job list */
 int deletejob(struct job_t *jobs, pid_t pid) 
 {
-    int i;
+    struct job_t *job = getjobpid(jobs, pid);
 
-    if (pid < 1)
+    if (job == NULL || job->pid != pid)
 	return 0;
+    removejob(job);
+    return 1;
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
-	}
+/* 
+ * removejob - Delete job from the job list. Unlike deletejob it works
+ *    once the job's processes are all reaped and no longer indexed.
+ */
+void removejob(struct job_t *job) 
+{
+    int j;
+
+    for (j = 0; j < job->nprocs; j++)
+	if (jobprocs(job)[j].state != PS_DONE)
+	    procdone(job, j);
+    jidindex[job->jid] = -1;
+
+    /* Hand a pipeline's process block back */
+    if (job->nprocs > 1) {
+	procpool[job->procoff].pid = freeprocs;
+	freeprocs = job->procoff;
     }
-    return 0;
+
+    /* Like before, hand out max JID + 1 next, but find it without a scan */
+    if (job->jid == nextjid - 1) {
+	while (nextjid > 1 && jidindex[nextjid - 1] < 0)
+	    nextjid--;
+    }
+
+    traceevent(TR_DELJOB, job->pid, job->jid, 0);
+    cmdrelease(job->cmdoff);
+    stats.jobs--;
+    setjobstate(job, UNDEF);
+    clearjob(job);
+
+    /* Push the slot onto the free list */
+    job->nextfree = freejob;
+    freejob = job - jobs;
+}
+
+/* 
+ * procdone - Process member of job has been reaped: mark it done, and
+ *    drop its PID from the pid index and its pidfd right away, since
+ *    the kernel may give the PID to a new job before this one ends
+ */
+void procdone(struct job_t *job, int member) {
+    struct proc_t *proc = &jobprocs(job)[member];
+
+    if (proc->state == PS_STOP)
+	job->nstopped--;
+    proc->state = PS_DONE;
+    job->nlive--;
+    pidindex_remove(proc->pid, job - jobs);
+    if (proc->pidfd >= 0) {
+	close(proc->pidfd); /* also drops it from the epoll set */
+	proc->pidfd = -1;
+    }
+}
+
+/* setjobstate - Change a job's state, keeping the foreground cache current */
+void setjobstate(struct job_t *job, int state) {
+    int slot = job - jobs;
+
+    if (state == FG)
+	fgslot = slot;
+    else if (fgslot == slot)
+	fgslot = -1;
+    nbgjobs += (state == BG) - (job->state == BG);
+    job->state = state;
+}
+
+/* 
+ * signaljob - Send sig to job's process group through one of its pidfds,
+ *    so it can't land on some unrelated process that reused the PID.
+ *    Falls back to kill(-pgid) when no pidfd can do it (all members
+ *    reaped, or a kernel without PIDFD_SIGNAL_PROCESS_GROUP).
+ *    A SIGCONT (only ever sent from the main loop) sets every stopped
+ *    process running again.
+ */
+int signaljob(struct job_t *job, int sig) {
+    struct proc_t *procs = jobprocs(job);
+    int j;
+
+    traceevent(sig == SIGCONT ? TR_CONT : TR_SIGNAL, job->pid, job->jid, sig);
+    if (sig == SIGCONT) {
+	for (j = 0; j < job->nprocs; j++)
+	    if (procs[j].state == PS_STOP)
+		procs[j].state = PS_RUN;
+	job->nstopped = 0;
+    }
+    for (j = 0; j < job->nprocs; j++)
+	if (procs[j].pidfd >= 0 &&
+	    syscall(SYS_pidfd_send_signal, procs[j].pidfd, sig, NULL,
+		    PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+	    return 0;
+    return kill(-job->pid, sig);
 }
 
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t fgpid(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+    if (fgslot < 0)
+	return 0;
+    return jobs[fgslot].pid;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
+/* getjobpid  - Find a job (by the PID of any of its processes) on the job list */
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+    int member;
+
+    return getjobproc(jobs, pid, &member);
+}
+
+/* 
+ * getjobproc - Like getjobpid, and also set *member to the index of
+ *    pid's process in the job's jobprocs()
+ */
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid, int *member) {
+    int slot;
 
     if (pid < 1)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    if ((slot = pidindex_find(pid, member)) < 0)
+	return NULL;
+    return &jobs[slot];
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
 struct job_t *getjobjid(struct job_t *jobs, int jid) 
 {
-    int i;
-
-    if (jid < 1)
+    if (jid < 1 || jid >= jidcap || jidindex[jid] < 0)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    return &jobs[jidindex[jid]];
 }
 
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid) 
 {
-    int i;
+    struct job_t *job = getjobpid(jobs, pid);
 
-    if (pid < 1)
+    if (job == NULL)
 	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+    return job->jid;
 }
 
 /* listjobs - Print the job list */
@@ -793,27 +2069,948 @@ void listjobs(struct job_t *jobs)
 {
     int i;
     
-    for (i = 0; i < MAXJOBS; i++) {
+    for (i = 0; i < maxjobs; i++) {
 	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+	    outf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
 	    switch (jobs[i].state) {
 		case BG: 
-		    printf("Running ");
+		    outf("Running ");
 		    break;
 		case FG: 
-		    printf("Foreground ");
+		    outf("Foreground ");
 		    break;
 		case ST: 
-		    printf("Stopped ");
+		    outf("Stopped ");
 		    break;
 	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
+		    outf("listjobs: Internal error: job[%d].state=%d ", 
 			   i, jobs[i].state);
 	    }
-	    printf("%s", jobs[i].cmdline);
+	    outf("%.*s", (int) jobs[i].cmdlen, jobcmdline(&jobs[i]));
 	}
     }
 }
+/* nowns - CLOCK_MONOTONIC now, in nanoseconds; safe in a handler */
+long long nowns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* outusage - Print one job's (or the totals') accounting fields; wall < 0 omits it */
+static void outusage(struct jobusage_t *u, long long wall) {
+    outf("user %lld.%03llds sys %lld.%03llds ",
+	 u->utime / 1000000, u->utime / 1000 % 1000,
+	 u->stime / 1000000, u->stime / 1000 % 1000);
+    if (wall >= 0)
+	outf("wall %lld.%03llds ", wall / 1000000000, wall / 1000000 % 1000);
+    outf("maxrss %ldK csw %ld/%ld", u->maxrss, u->nvcsw, u->nivcsw);
+}
+
+/* 
+ * listjobslong - jobs -l: like listjobs, plus every process's PID (with
+ *    /stopped or /done if it isn't running) and what the job has used
+ *    so far. CPU, RSS and context switches only
+ *    count processes already reaped; wall time runs from launch.
+ */
+void listjobslong(struct job_t *jobs) {
+    static char *states[] = { "Undefined", "Foreground", "Running", "Stopped" };
+    static char *pstates[] = { "", "/stopped", "/done" };
+    long long now = nowns();
+    int i, j;
+
+    for (i = 0; i < maxjobs; i++) {
+	if (jobs[i].pid == 0)
+	    continue;
+	outf("[%d] %s ", jobs[i].jid, states[jobs[i].state]);
+	for (j = 0; j < jobs[i].nprocs; j++)
+	    outf("%s%d%s", j ? "," : "(", jobprocs(&jobs[i])[j].pid,
+		 pstates[jobprocs(&jobs[i])[j].state]);
+	outf(") ");
+	outusage(&jobs[i].usage, now - jobs[i].started);
+	outf(" %.*s", (int) jobs[i].cmdlen, jobcmdline(&jobs[i]));
+    }
+}
+
+/* 
+ * do_times - Execute the builtin times command: accounting for each
+ *    live job, the totals over finished jobs, and the shell itself
+ */
+void do_times(void) {
+    struct jobusage_t self;
+    struct rusage ru;
+    long long now = nowns();
+    int i;
+
+    for (i = 0; i < maxjobs; i++) {
+	if (jobs[i].pid == 0)
+	    continue;
+	outf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+	outusage(&jobs[i].usage, now - jobs[i].started);
+	outf("\n");
+    }
+
+    outf("finished (%d jobs) ", donejobs);
+    outusage(&doneusage, doneusage.wall);
+    outf("\n");
+
+    getrusage(RUSAGE_SELF, &ru);
+    self.utime = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec;
+    self.stime = ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+    self.maxrss = ru.ru_maxrss;
+    self.nvcsw = ru.ru_nvcsw;
+    self.nivcsw = ru.ru_nivcsw;
+    outf("shell ");
+    outusage(&self, -1);
+    outf("\n");
+}
+
 /******************************
  * end job list helper routines
- ******************************/
\ No newline at end of file
+ ******************************/
+
+/***********************************************
+ * Command lookup routines: PATH search with a cache of resolved paths,
+ * like the hash builtin in bash.
+ **********************************************/
+
+/* cmdhash - Bucket for command name in the path cache */
+static unsigned int cmdhash(char *name) {
+    unsigned int h = 5381;
+
+    while (*name)
+	h = h * 33 + (unsigned char) *name++;
+    return h % CMDHASH;
+}
+
+/* 
+ * searchpath - Walk the directories in PATH for an executable called name.
+ *    Returns a malloc'ed path, or NULL if there is none.
+ */
+static char *searchpath(char *name) {
+    char *dirs = getenv("PATH"), *end;
+    char buf[MAXLINE];
+    struct stat sb;
+    int len;
+
+    if (dirs == NULL)
+	dirs = "/bin:/usr/bin";
+    while (1) {
+	end = strchr(dirs, ':');
+	len = end ? end - dirs : (int) strlen(dirs);
+	/* An empty entry means the current directory */
+	if (len == 0)
+	    snprintf(buf, sizeof(buf), "%s", name);
+	else
+	    snprintf(buf, sizeof(buf), "%.*s/%s", len, dirs, name);
+	if (stat(buf, &sb) == 0 && S_ISREG(sb.st_mode) && access(buf, X_OK) == 0)
+	    return strdup(buf);
+	if (end == NULL)
+	    return NULL;
+	dirs = end + 1;
+    }
+}
+
+/* 
+ * findcommand - Return the program to execute for name. Names containing
+ *    a '/' are used as they are; anything else is looked up in the cache
+ *    and then, on a miss, in PATH. Returns NULL if it can't be found.
+ */
+char *findcommand(char *name) {
+    struct cmdpath_t *entry;
+    char *path = getenv("PATH");
+    unsigned int h;
+
+    if (strchr(name, '/') != NULL)
+	return name;
+
+    /* Anything cached under a different PATH may now resolve elsewhere */
+    if (path == NULL)
+	path = "";
+    if (cmdcachepath == NULL || strcmp(cmdcachepath, path) != 0) {
+	clearcommands();
+	cmdcachepath = strdup(path);
+    }
+
+    h = cmdhash(name);
+    for (entry = cmdcache[h]; entry != NULL; entry = entry->next) {
+	if (strcmp(entry->name, name) == 0) {
+	    entry->hits++;
+	    return entry->path;
+	}
+    }
+
+    if ((path = searchpath(name)) == NULL)
+	return NULL;
+    if ((entry = malloc(sizeof(struct cmdpath_t))) == NULL ||
+	(entry->name = strdup(name)) == NULL) {
+	free(entry);
+	free(path);
+	return NULL;
+    }
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = cmdcache[h];
+    cmdcache[h] = entry;
+    return entry->path;
+}
+
+/* forgetcommand - Drop name from the path cache (e.g. after ENOENT) */
+void forgetcommand(char *name) {
+    struct cmdpath_t **link = &cmdcache[cmdhash(name)], *entry;
+
+    for (; (entry = *link) != NULL; link = &entry->next) {
+	if (strcmp(entry->name, name) == 0) {
+	    *link = entry->next;
+	    free(entry->name);
+	    free(entry->path);
+	    free(entry);
+	    return;
+	}
+    }
+}
+
+/* clearcommands - Empty the path cache */
+void clearcommands(void) {
+    struct cmdpath_t *entry, *next;
+    int i;
+
+    for (i = 0; i < CMDHASH; i++) {
+	for (entry = cmdcache[i]; entry != NULL; entry = next) {
+	    next = entry->next;
+	    free(entry->name);
+	    free(entry->path);
+	    free(entry);
+	}
+	cmdcache[i] = NULL;
+    }
+    free(cmdcachepath);
+    cmdcachepath = NULL;
+}
+
+/* 
+ * do_hash - Execute the builtin hash command
+ *    hash          list the cached commands
+ *    hash -r       forget every cached command
+ *    hash name...  look up each name and cache it
+ */
+void do_hash(char **argv) {
+    struct cmdpath_t *entry;
+    int i, empty = 1;
+
+    if (argv[1] == NULL) {
+	for (i = 0; i < CMDHASH; i++) {
+	    for (entry = cmdcache[i]; entry != NULL; entry = entry->next) {
+		if (empty)
+		    outf("hits\tcommand\n");
+		empty = 0;
+		outf("%4d\t%s\n", entry->hits, entry->path);
+	    }
+	}
+	if (empty)
+	    outf("hash: hash table empty\n");
+	return;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+	clearcommands();
+	return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+	if (strchr(argv[i], '/') != NULL)
+	    continue;
+	forgetcommand(argv[i]);
+	if (findcommand(argv[i]) == NULL)
+	    outf("hash: %s: not found\n", argv[i]);
+    }
+}
+
+/***********************************************
+ * Event loop routines (-e). SIGCHLD, SIGINT and SIGTSTP stay blocked and
+ * are read from a signalfd, so the "handlers" run synchronously from the
+ * main loop and never interrupt it.
+ **********************************************/
+
+/* 
+ * initevents - Block the job-control signals, route them to a signalfd,
+ *    and build the epoll sets used by waitfg and the main loop
+ */
+void initevents(void) {
+    struct epoll_event ev;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    protectedSigprocmask(SIG_BLOCK, &mask, NULL);
+
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+	unix_error("signalfd error");
+    if ((jobepfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	(mainepfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create1 error");
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.fd = sigfd;
+    if (epoll_ctl(jobepfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+
+    /* The main loop waits on job events and stdin together */
+    ev.data.fd = jobepfd;
+    if (epoll_ctl(mainepfd, EPOLL_CTL_ADD, jobepfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(mainepfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+	if (errno != EPERM)
+	    unix_error("epoll_ctl error");
+	stdinpollable = 0; /* regular file: always readable, just read it */
+    }
+}
+
+/* 
+ * reapstopped - With every exit watched through a pidfd, SIGCHLD only
+ *    matters for stops. Collect those without touching exited children.
+ */
+static void reapstopped(void) {
+    siginfo_t info;
+
+    while (1) {
+	info.si_pid = 0;
+	if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) < 0 || info.si_pid == 0)
+	    return;
+	reapchild(info.si_pid, W_STOPCODE(info.si_status), NULL, nowns());
+    }
+}
+
+/* 
+ * reappid - A job process's pidfd became readable: it exited, so reap
+ *    exactly that process
+ */
+static void reappid(pid_t pid) {
+    struct rusage ru;
+    int status;
+
+    if (wait4(pid, &status, WNOHANG, &ru) > 0)
+	reapchild(pid, status, &ru, nowns());
+}
+
+/* 
+ * handlesignals - Drain the signalfd and run the handler for each signal.
+ *    A burst of SIGCHLDs is handled with one sigchld_handler call, since
+ *    it reaps every child that is ready anyway, and one drainchld.
+ */
+static void handlesignals(void) {
+    struct signalfd_siginfo info[16];
+    int n, i, gotchld = 0;
+
+    while ((n = read(sigfd, info, sizeof(info))) > 0) {
+	for (i = 0; i < n / (int) sizeof(info[0]); i++) {
+	    switch (info[i].ssi_signo) {
+	    case SIGCHLD:
+		stats.sigchlds++;
+		gotchld = 1;
+		break;
+	    case SIGINT:
+		sigint_handler(SIGINT);
+		break;
+	    case SIGTSTP:
+		sigtstp_handler(SIGTSTP);
+		break;
+	    }
+	}
+    }
+    if (gotchld && !pidfdsok) {
+	sigchld_handler(SIGCHLD);
+	drainchld();
+    }
+    else if (gotchld)
+	reapstopped();
+}
+
+/* 
+ * handleevents - Wait up to timeout ms (-1 = forever) for job events and
+ *    handle whatever is ready
+ */
+void handleevents(int timeout) {
+    struct epoll_event ev[8];
+    int n, i;
+
+    if ((n = epoll_wait(jobepfd, ev, 8, timeout)) < 0) {
+	if (errno == EINTR)
+	    return;
+	unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+	if (ev[i].data.u64 & PIDEVENT)
+	    reappid((pid_t) (ev[i].data.u64 & 0xffffffff));
+	else if (ev[i].data.fd == sigfd)
+	    handlesignals();
+    }
+}
+
+/* 
+ * eventreadline - Read the next line of input into cmdline (like fgets),
+ *    handling job events while we wait for it. Returns NULL at end of
+ *    file; like the fgets loop, a final line without a newline is dropped.
+ */
+char *eventreadline(char *cmdline) {
+    struct epoll_event ev[2];
+    char *nl;
+    int n, i, len;
+
+    while (1) {
+	/* A whole line (or a full buffer) is waiting: hand it out */
+	nl = memchr(inbuf, '\n', inlen);
+	if (nl != NULL || inlen == MAXLINE - 1) {
+	    len = nl ? nl - inbuf + 1 : inlen;
+	    memcpy(cmdline, inbuf, len);
+	    cmdline[len] = '\0';
+	    inlen -= len;
+	    memmove(inbuf, inbuf + len, inlen);
+	    return cmdline;
+	}
+	if (ineof)
+	    return NULL;
+
+	if (!stdinpollable) {
+	    handleevents(0);
+	    n = 1;
+	    ev[0].data.fd = STDIN_FILENO;
+	} else if ((n = epoll_wait(mainepfd, ev, 2, -1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+
+	for (i = 0; i < n; i++) {
+	    if (ev[i].data.fd == jobepfd) {
+		handleevents(0);
+		outflush(); /* job notices while idle */
+	    } else {
+		len = read(STDIN_FILENO, inbuf + inlen, MAXLINE - 1 - inlen);
+		if (len < 0 && errno != EINTR && errno != EAGAIN)
+		    app_error("read error");
+		if (len == 0)
+		    ineof = 1;
+		if (len > 0)
+		    inlen += len;
+	    }
+	}
+    }
+}
+
+/***********************************************
+ * Script mode routines (-f)
+ **********************************************/
+
+/* 
+ * runscript - Evaluate every line of filename, then wait for its
+ *    background jobs and exit. The file is mapped privately and each
+ *    line is handed to eval where it lies: the byte after its newline
+ *    is swapped for a '\0' and put back afterwards. Lines can be any
+ *    length, since the parser keeps its state in cmdarena. Output is
+ *    flushed in batches (see eval) rather than after every command.
+ */
+void runscript(char *filename) {
+    char *lastline; /* copy of the final line, which has no byte after it to borrow */
+    struct stat st;
+    char *map, *line, *nl, *end, saved;
+    size_t len;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    map = NULL;
+    if (st.st_size > 0 &&
+	(map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	unix_error("mmap error");
+    close(fd);
+
+    batchout = 1; /* the output ring is only drained when it fills */
+
+    end = map + st.st_size;
+    for (line = map; line < end; line = nl + 1) {
+	if ((nl = memchr(line, '\n', end - line)) == NULL)
+	    nl = end - 1;
+	len = nl - line + 1;
+
+	drainchld();
+	if (useevents)
+	    handleevents(0); /* nothing else runs the event loop between jobs */
+
+	if (nl + 1 < end) {
+	    saved = nl[1];
+	    nl[1] = '\0';
+	    eval(line);
+	    nl[1] = saved;
+	} else {
+	    lastline = arenaalloc(&cmdarena, len + 2);
+	    memcpy(lastline, line, len);
+	    if (*nl != '\n') /* eval wants the newline fgets would keep */
+		lastline[len++] = '\n';
+	    lastline[len] = '\0';
+	    eval(lastline);
+	}
+	arenareset(&cmdarena);
+    }
+
+    if (map != NULL)
+	munmap(map, st.st_size);
+    waitbg(1);
+    quitshell();
+}
+
+/***********************************************
+ * Parallel runner routines (par)
+ **********************************************/
+
+/* 
+ * do_par - Execute the builtin par command:
+ *
+ *    par [-j N] cmd [args...] ::: arg...
+ *
+ *    runs "cmd args... arg" once for each arg after :::, with at most N
+ *    (default: the number of CPUs) running at a time. The runs are
+ *    ordinary background jobs, so they show up in jobs, but they aren't
+ *    announced, and par waits for them like a foreground job: ctrl-c
+ *    goes to all of them and stops par from starting more, and ctrl-z
+ *    stops them and leaves them in the job list. At the end par reports
+ *    how many runs failed (exited nonzero or were killed).
+ */
+void do_par(char **argv) {
+    char **cargv;           /* argv of one run: cmd, args, arg, NULL */
+    sigset_t mask, prev_mask;
+    int limit, nfixed, first, i, started;
+    char *path;
+    pid_t pid;
+
+    i = 1;
+    limit = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argv[i] != NULL && !strcmp(argv[i], "-j")) {
+	if (argv[i + 1] == NULL || (limit = atoi(argv[i + 1])) < 1) {
+	    outf("par: -j needs a positive count\n");
+	    return;
+	}
+	i += 2;
+    }
+    if (limit < 1)
+	limit = 1;
+
+    /* cmd and its fixed args run up to the ::: */
+    for (nfixed = 0; argv[i + nfixed] != NULL && strcmp(argv[i + nfixed], ":::"); nfixed++)
+	;
+    if (nfixed == 0 || argv[i + nfixed] == NULL) {
+	outf("usage: par [-j N] cmd [args...] ::: arg...\n");
+	return;
+    }
+    cargv = arenaalloc(&cmdarena, (nfixed + 2) * sizeof(char *));
+    memcpy(cargv, &argv[i], nfixed * sizeof(char *));
+    cargv[nfixed + 1] = NULL;
+    first = i + nfixed + 1;
+
+    if ((path = findcommand(cargv[0])) == NULL) {
+	outf("%s: Command not found\n", cargv[0]);
+	return;
+    }
+
+    parfailed = 0;
+    parhalt = 0;
+    started = 0;
+
+    /* As in waitfg, SIGCHLD stays blocked between draining the child
+     * ring and sigsuspend, so no wakeup is lost */
+    protectedSigemptyset(&mask);
+    protectedSigaddset(&mask, SIGCHLD);
+    if (!useevents)
+	protectedSigprocmask(SIG_BLOCK, &mask, &prev_mask);
+
+    for (i = first; argv[i] != NULL && !parhalt; i++) {
+	drainchld();
+	while (parlive >= limit) {
+	    if (useevents)
+		handleevents(-1);
+	    else
+		sigsuspend(&prev_mask);
+	    drainchld();
+	}
+	if (parhalt)
+	    break;
+
+	cargv[nfixed] = argv[i];
+	if (usefork)
+	    pid = forkStage(path, cargv, 0, STDIN_FILENO, STDOUT_FILENO, &childmask);
+	else
+	    pid = spawnStage(path, cargv, 0, STDIN_FILENO, STDOUT_FILENO, &childmask);
+	started++;
+	if (pid <= 0) {
+	    parfailed++;
+	    continue;
+	}
+
+	/* Job text is the command this run executes */
+	snprintf(sbuf, MAXLINE, "%s", cargv[0]);
+	for (int j = 1; cargv[j] != NULL; j++)
+	    snprintf(sbuf + strlen(sbuf), MAXLINE - strlen(sbuf), " %s", cargv[j]);
+	snprintf(sbuf + strlen(sbuf), MAXLINE - strlen(sbuf), "\n");
+	if (!addjob(jobs, &pid, 1, BG, sbuf)) {
+	    parfailed++;
+	    continue;
+	}
+	getjobpid(jobs, pid)->par = 1;
+	parlive++;
+    }
+
+    drainchld();
+    while (parlive > 0) {
+	if (useevents)
+	    handleevents(-1);
+	else
+	    sigsuspend(&prev_mask);
+	drainchld();
+    }
+    if (!useevents)
+	protectedSigprocmask(SIG_SETMASK, &prev_mask, NULL);
+
+    outf("par: %d of %d failed%s\n", parfailed, started,
+	   parhalt ? " (interrupted)" : "");
+}
+
+/* 
+ * signalpar - Forward a keyboard signal to every running par job.
+ *    Called from the ctrl-c/ctrl-z handlers.
+ */
+void signalpar(int sig) {
+    int i;
+
+    parhalt = 1;
+    for (i = 0; i < maxjobs; i++)
+	if (jobs[i].pid != 0 && jobs[i].par)
+	    signaljob(&jobs[i], sig);
+}
+
+/***********************************************
+ * Statistics routines (stats, -s)
+ **********************************************/
+
+/* printstats - Execute the builtin stats command: print the counters */
+void printstats(void) {
+    outf("evals %lu launches %lu execfails %lu\n",
+	 stats.evals, stats.launches, stats.execfails);
+    outf("sigchld %lu handler runs %lu reaped %lu (most in one run %lu)\n",
+	 stats.sigchlds, stats.reapruns, stats.reaps, stats.maxreaps);
+    outf("waitfg wakeups %lu sigprocmask %lu jobs high water %d\n",
+	 stats.fgwakeups, stats.sigprocmasks, stats.jobshigh);
+}
+
+/* quitshell - Leave the shell, with the -s stats dump if asked for */
+void quitshell(void) {
+    if (dumpstats)
+	printstats();
+    outflush();
+    exit(0);
+}
+
+/***********************************************
+ * Event trace routines (-t). tshtrace turns the file into a timeline.
+ **********************************************/
+
+/* opentrace - Create filename as an empty trace ring and map it */
+void opentrace(char *filename) {
+    size_t size = sizeof(struct tracehdr_t) + TRACERECS * sizeof(struct tracerec_t);
+    void *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+	ftruncate(fd, size) < 0)
+	unix_error(filename);
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	unix_error("mmap error");
+    close(fd);
+
+    tracering = map;
+    memcpy(tracering->magic, "tshtrace", 8);
+    tracering->recsize = sizeof(struct tracerec_t);
+    tracering->nrecs = TRACERECS;
+    tracering->head = 0;
+}
+
+/* 
+ * traceevent - Append one record to the trace ring, if there is one.
+ *    Safe in a handler: the slot is claimed with an atomic add, so an
+ *    interrupted append and the handler's never share a record.
+ */
+void traceevent(int type, pid_t pid, int jid, int arg) {
+    struct tracerec_t *rec;
+    uint64_t i;
+
+    if (tracering == NULL)
+	return;
+    i = __atomic_fetch_add(&tracering->head, 1, __ATOMIC_RELAXED);
+    rec = (struct tracerec_t *) (tracering + 1) + (i & (TRACERECS - 1));
+    rec->ns = nowns();
+    rec->type = type;
+    rec->pid = pid;
+    rec->jid = jid;
+    rec->arg = arg;
+}
+
+/***********************************************
+ * time keyword routines
+ **********************************************/
+
+/* outdur - Print a duration in ns with three decimals of a fitting unit */
+static void outdur(long long ns) {
+    if (ns < 0)
+	ns = 0;
+    if (ns < 1000000)
+	outf("%lld.%03lldus", ns / 1000, ns % 1000);
+    else if (ns < 1000000000)
+	outf("%lld.%03lldms", ns / 1000000, ns / 1000 % 1000);
+    else
+	outf("%lld.%03llds", ns / 1000000000, ns / 1000000 % 1000);
+}
+
+/* 
+ * timereport - Print what time measured: wall time from eval to the
+ *    last reap, the job's CPU time, and where the shell's share went:
+ *
+ *    parse          parsecmdline
+ *    spawn          PATH lookup and forking/spawning every stage
+ *    exec->sigchld  from the last stage starting to the first reap
+ *    sigchld->reap  from the first reap to the last (pipelines)
+ *    reap->prompt   from the last reap to this report, just before
+ *                   the prompt goes out
+ *
+ *    For a builtin, exec->sigchld is the time the builtin ran.
+ */
+void timereport(struct jobusage_t *u, long long reaped) {
+    long long now = nowns();
+
+    outf("real ");
+    outdur(reaped - timed.start);
+    outf(" user %lld.%03llds sys %lld.%03llds\n",
+	 u->utime / 1000000, u->utime / 1000 % 1000,
+	 u->stime / 1000000, u->stime / 1000 % 1000);
+    outf("parse ");
+    outdur(timed.parsed - timed.start);
+    outf(" spawn ");
+    outdur(timed.spawned - timed.parsed);
+    outf(" exec->sigchld ");
+    outdur(timed.firstchld - timed.spawned);
+    outf(" sigchld->reap ");
+    outdur(reaped - timed.firstchld);
+    outf(" reap->prompt ");
+    outdur(now - reaped);
+    outf("\n");
+}
+
+/***********************************************
+ * Arena routines: a bump allocator for the parse state of one command.
+ * Chunks are never freed, just reused after arenareset, so a shell that
+ * once saw a long line keeps enough memory to parse another one.
+ **********************************************/
+
+/* arenanext - Move arena on to a chunk (reused or new) with n bytes free */
+static void arenanext(struct arena_t *arena, size_t n) {
+    struct chunk_t *chunk;
+
+    while (arena->cur == NULL || arena->used + n > arena->cur->size) {
+	chunk = arena->cur ? arena->cur->next : arena->first;
+	if (chunk == NULL) {
+	    size_t size = n > ARENACHUNK ? n : ARENACHUNK;
+	    if ((chunk = malloc(sizeof(*chunk) + size)) == NULL)
+		app_error("Out of memory");
+	    chunk->size = size;
+	    chunk->next = NULL;
+	    if (arena->cur)
+		arena->cur->next = chunk;
+	    else
+		arena->first = chunk;
+	}
+	arena->cur = chunk;
+	arena->used = 0;
+    }
+}
+
+/* 
+ * arenaalloc - Return n bytes from arena, aligned for any type. They
+ *    stay valid until the arena is reset.
+ */
+void *arenaalloc(struct arena_t *arena, size_t n) {
+    void *p;
+
+    n = (n + 15) & ~(size_t) 15;
+    if (arena->cur == NULL || arena->used + n > arena->cur->size)
+	arenanext(arena, n);
+    p = arena->cur->data + arena->used;
+    arena->used += n;
+    return p;
+}
+
+/* arenareset - Free everything allocated from arena, in O(1) */
+void arenareset(struct arena_t *arena) {
+    arena->cur = arena->first;
+    arena->used = 0;
+}
+
+/***********************************************
+ * Output routines. The shell's messages are formatted into a ring and
+ * written out with one writev when the main loop is about to wait for
+ * input, instead of going through stdio. Job notices are queued by
+ * drainchld, in the main loop, so they land between commands' output.
+ **********************************************/
+
+/* 
+ * outfmt - Format fmt into buf (at most size bytes, no '\0'). Knows
+ *    %d and %u (with an optional width, space or 0 padded, and l or ll
+ *    for long or long long), %s, %.*s, %c and %%; that is all the shell
+ *    uses. Returns the length the text would
+ *    have had with room for all of it, like vsnprintf.
+ */
+static size_t outfmt(char *buf, size_t size, const char *fmt, va_list ap) {
+    char num[24];
+    size_t n = 0;
+    const char *s;
+    int width, prec, len, neg, lng;
+    char pad;
+    long long v;
+    unsigned long long u;
+
+#define OUTC(c) do { char c_ = (c); if (n < size) buf[n] = c_; n++; } while (0)
+    for (; *fmt; fmt++) {
+	if (*fmt != '%') {
+	    OUTC(*fmt);
+	    continue;
+	}
+	fmt++;
+	width = 0;
+	prec = -1;
+	pad = ' ';
+	if (*fmt == '0')
+	    pad = *fmt++;
+	while (*fmt >= '0' && *fmt <= '9')
+	    width = width * 10 + *fmt++ - '0';
+	if (fmt[0] == '.' && fmt[1] == '*') {
+	    prec = va_arg(ap, int);
+	    fmt += 2;
+	}
+	for (lng = 0; *fmt == 'l'; fmt++)
+	    lng++;
+	switch (*fmt) {
+	case 'd':
+	case 'u':
+	    if (*fmt == 'd') {
+		v = lng == 0 ? va_arg(ap, int) :
+		    lng == 1 ? va_arg(ap, long) : va_arg(ap, long long);
+		neg = v < 0;
+		u = neg ? -(unsigned long long) v : (unsigned long long) v;
+	    } else {
+		u = lng == 0 ? va_arg(ap, unsigned int) :
+		    lng == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned long long);
+		neg = 0;
+	    }
+	    len = 0;
+	    do {
+		num[len++] = '0' + u % 10;
+	    } while ((u /= 10) != 0);
+	    if (neg)
+		num[len++] = '-';
+	    for (; width > len; width--)
+		OUTC(pad);
+	    while (len > 0)
+		OUTC(num[--len]);
+	    break;
+	case 's':
+	    s = va_arg(ap, const char *);
+	    for (; *s && prec != 0; prec--)
+		OUTC(*s++);
+	    break;
+	case 'c':
+	    OUTC((char) va_arg(ap, int));
+	    break;
+	case '\0':
+	    return n;
+	default:
+	    OUTC(*fmt);
+	}
+    }
+#undef OUTC
+    return n;
+}
+
+/* 
+ * outf - printf into the output ring. Main loop only: the signal
+ *    handlers never print (sigquit_handler writes its one message
+ *    directly). If the ring is full, it is drained first. Text too long
+ *    for the ring, a long jobs line say, goes out with its own write
+ *    after what is already queued.
+ */
+void outf(const char *fmt, ...) {
+    char buf[OUTBUF / 2], *big;
+    unsigned int tail, at, first;
+    size_t n, off;
+    ssize_t w;
+    va_list ap;
+
+    va_start(ap, fmt);
+    n = outfmt(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n > sizeof(buf)) {
+	if ((big = malloc(n)) == NULL)
+	    app_error("Out of memory");
+	va_start(ap, fmt);
+	outfmt(big, n, fmt, ap);
+	va_end(ap);
+	outflush();
+	for (off = 0; off < n; off += w) {
+	    if ((w = write(STDOUT_FILENO, big + off, n - off)) < 0) {
+		if (errno != EINTR)
+		    break; /* nowhere to write it, as in outflush */
+		w = 0;
+	    }
+	}
+	free(big);
+	return;
+    }
+
+    tail = outtail;
+    if (tail - outhead + n > OUTBUF) {
+	outflush();
+	tail = outtail;
+    }
+    outtail = tail + n;
+
+    at = tail & (OUTBUF - 1);
+    first = n < OUTBUF - at ? n : OUTBUF - at;
+    memcpy(outring + at, buf, first);
+    memcpy(outring, buf + first, n - first);
+}
+
+/* 
+ * outflush - Write out everything in the ring
+ */
+void outflush(void) {
+    unsigned int head = outhead, tail = outtail, at;
+    struct iovec iov[2];
+    ssize_t n;
+
+    while (head != tail) {
+	at = head & (OUTBUF - 1);
+	iov[0].iov_base = outring + at;
+	iov[0].iov_len = tail - head < OUTBUF - at ? tail - head : OUTBUF - at;
+	iov[1].iov_base = outring;
+	iov[1].iov_len = (tail - head) - iov[0].iov_len;
+	if ((n = writev(STDOUT_FILENO, iov, iov[1].iov_len ? 2 : 1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break; /* nowhere to write it; drop it rather than spin */
+	}
+	head += n;
+    }
+    outhead = tail;
+}
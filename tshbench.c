@@ -0,0 +1,653 @@
+/*
+ * tshbench.c - Measure how long a shell takes to give back its prompt,
+ *     and how it holds up under job-control load
+ *
+ * usage: tshbench [-hN] [-s <shell>] [-a <args>] [-n <count>] [-c <cmd>]
+ *                 [-w <workloads>] [-b <burst>] [-o <csv file>]
+ *
+ * Runs the shell as a child with its stdin and stdout connected to
+ * pipes, sends <cmd> <count> times, and times each round trip from
+ * writing the command line to reading the next "tsh> " prompt. The
+ * shell must be run without -p, since the prompt is what we wait for.
+ *
+ * With a background command (e.g. -c "/bin/true &") the round trip is
+ * just the launch, so jobs/sec measures how fast the shell starts jobs.
+ *
+ * -w runs these workloads instead (a comma-separated list, or "all"),
+ * each <count> operations long:
+ *
+ *   fg       <cmd> in the foreground, as above
+ *   burst    background jobs started <burst> at a time, then all told to
+ *            exit at once, so their SIGCHLDs pile up in the reap loop
+ *   bgfg     one job moved back and forth: fg plus ctrl-z, then bg
+ *   signals  a foreground job stopped with ctrl-z, resumed with fg and
+ *            killed with ctrl-c, over and over
+ *
+ * The jobs are this program run as "tshbench -x <pid>": it says it is
+ * ready, then waits for SIGUSR1 and says when it exits. It gives up once
+ * tshbench (<pid>) is gone, and tshbench kills the jobs it still has
+ * when it quits, so an aborted run leaves none behind. For burst, the shell is
+ * also run with -t, and the time from a job's exit to its deljob event
+ * in the trace ring is its reap latency; -N skips that for shells
+ * without -t. tshref, say, wants -N and a -b under its 16 jobs.
+ *
+ * -o appends one line per workload to a CSV file (header included when
+ * the file is new) for tracking results over time.
+ *
+ * This file includes tsh.c with TSH_NO_MAIN for the trace ring layout.
+ */
+#define TSH_NO_MAIN
+#include "tsh.c"
+
+#include <poll.h>
+
+#define INBUF 65536         /* bytes of shell output kept unconsumed */
+#define REPLYMS 10000       /* ms to wait for the shell before giving up */
+#define RESENDMS 50         /* ms before a signal the shell missed is resent */
+
+static char *shell = "./tsh", *shellargs = NULL;
+static pid_t shellpid;
+static int to_shell, from_shell;
+static char self[MAXLINE];  /* this program, for the -x jobs */
+
+/* Shell output: consumed up to ipos by expect, scanned for the jobs'
+   @r and @x lines up to lpos */
+static char ibuf[INBUF];
+static size_t ilen, ipos, lpos;
+
+static pid_t *ready;        /* jobs that have said they're ready */
+static int nready;
+static pid_t *exitpid;      /* jobs that have said they're exiting */
+static long long *exitns;   /* and when */
+static int nexits, exitsize;
+
+static double *lat, *reaplat;
+static int nlat, nreap;
+
+static void benchusage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-hN] [-s <shell>] [-a <args>] [-n <count>] [-c <cmd>]\n", prog);
+    fprintf(stderr, "       [-w <workloads>] [-b <burst>] [-o <csv file>]\n");
+    fprintf(stderr, "   -h          print this message\n");
+    fprintf(stderr, "   -s <shell>  shell to benchmark (default ./tsh)\n");
+    fprintf(stderr, "   -a <args>   extra argument passed to the shell\n");
+    fprintf(stderr, "   -n <count>  number of commands (operations) to time (default 100)\n");
+    fprintf(stderr, "   -c <cmd>    command to run (default /bin/true)\n");
+    fprintf(stderr, "   -w <list>   workloads: fg,burst,bgfg,signals or all\n");
+    fprintf(stderr, "   -b <burst>  background jobs per burst (default 32)\n");
+    fprintf(stderr, "   -o <file>   append the results to a CSV file\n");
+    fprintf(stderr, "   -N          shell has no -t trace: no reap latency\n");
+    exit(1);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * The -x job
+ */
+static void benchjob(pid_t bench)
+{
+    char line[64];
+    sigset_t mask;
+    struct timespec ts, check = { 1, 0 };
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    snprintf(line, sizeof(line), "@r %d\n", (int) getpid());
+    if (write(1, line, strlen(line)) < 0)
+        exit(1);
+
+    /* Wait for SIGUSR1, but not for a tshbench that has died */
+    while (sigtimedwait(&mask, NULL, &check) < 0) {
+        if (kill(bench, 0) < 0 && errno == ESRCH)
+            exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    snprintf(line, sizeof(line), "@x %d %lld\n", (int) getpid(),
+             ts.tv_sec * 1000000000LL + ts.tv_nsec);
+    if (write(1, line, strlen(line)) < 0)
+        exit(1);
+    exit(0);
+}
+
+/*
+ * Talking to the shell
+ */
+
+/* fill - Read more of the shell's output, waiting at most ms. Returns
+   -1 at end of file, 0 if nothing came. */
+static int fill(int ms)
+{
+    struct pollfd pfd = { from_shell, POLLIN, 0 };
+    size_t keep;
+    char *p, *nl;
+    int n, pid;
+    long long ns;
+
+    if (poll(&pfd, 1, ms) <= 0)
+        return 0;
+
+    /* Make room, dropping what both cursors are past */
+    keep = ipos < lpos ? ipos : lpos;
+    memmove(ibuf, ibuf + keep, ilen - keep);
+    ilen -= keep;
+    ipos -= keep;
+    lpos -= keep;
+    if (ilen == sizeof(ibuf)) {
+        fprintf(stderr, "tshbench: too much unread output from %s\n", shell);
+        exit(1);
+    }
+    if ((n = read(from_shell, ibuf + ilen, sizeof(ibuf) - ilen)) <= 0)
+        return -1;
+    ilen += n;
+
+    /* Note the jobs' lines as they come */
+    while ((nl = memchr(ibuf + lpos, '\n', ilen - lpos)) != NULL) {
+        *nl = '\0';
+        if ((p = strstr(ibuf + lpos, "@r ")) != NULL) {
+            ready[nready++] = atoi(p + 3);
+        } else if ((p = strstr(ibuf + lpos, "@x ")) != NULL &&
+                   sscanf(p + 3, "%d %lld", &pid, &ns) == 2) {
+            if (nexits == exitsize) {
+                exitsize = exitsize ? exitsize * 2 : 1024;
+                exitpid = realloc(exitpid, exitsize * sizeof(*exitpid));
+                exitns = realloc(exitns, exitsize * sizeof(*exitns));
+                if (exitpid == NULL || exitns == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            exitpid[nexits] = pid;
+            exitns[nexits++] = ns;
+        }
+        *nl = '\n';
+        lpos = nl + 1 - ibuf;
+    }
+    return 1;
+}
+
+/* expect - Read until the shell has written text, and consume through
+   it. Returns where the skipped output starts, with its length in
+   skipped, or NULL after ms. */
+static size_t skipped;
+
+static char *expect(char *text, int ms)
+{
+    double deadline = now_us() + ms * 1e3;
+    char *found, *start;
+    int left;
+
+    while ((found = memmem(ibuf + ipos, ilen - ipos, text, strlen(text))) == NULL) {
+        if ((left = (deadline - now_us()) / 1e3) <= 0 || fill(left) < 0)
+            return NULL;
+    }
+    start = ibuf + ipos;
+    skipped = found - start;
+    ipos = found + strlen(text) - ibuf;
+    return start;
+}
+
+/* killjobs - Kill the -x jobs that are still the shell's children. The
+   check keeps us off PIDs that have been reused since a job exited. */
+static void killjobs(void)
+{
+    char path[64], buf[256], *p;
+    int i, fd, n, ppid;
+
+    for (i = 0; i < nready; i++) {
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int) ready[i]);
+        if ((fd = open(path, O_RDONLY)) < 0)
+            continue;
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[n > 0 ? n : 0] = '\0';
+        if ((p = strrchr(buf, ')')) != NULL &&
+            sscanf(p + 2, "%*c %d", &ppid) == 1 && ppid == shellpid)
+            kill(ready[i], SIGKILL);
+    }
+}
+
+static void gaveup(char *what)
+{
+    fprintf(stderr, "tshbench: %s: no reply from %s\n", what, shell);
+    killjobs();
+    kill(shellpid, SIGKILL);
+    exit(1);
+}
+
+static void sendcmd(char *fmt, ...)
+{
+    char line[MAXLINE];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    strcat(line, "\n");
+    if (write(to_shell, line, strlen(line)) < 0) {
+        perror("write");
+        exit(1);
+    }
+}
+
+static void prompt_or_die(char *what)
+{
+    if (expect(prompt, REPLYMS) == NULL)
+        gaveup(what);
+}
+
+/* waitready - Wait until n jobs in all have said they're ready */
+static void waitready(int n, char *what)
+{
+    double deadline = now_us() + REPLYMS * 1e3;
+
+    while (nready < n) {
+        if (now_us() >= deadline || fill((deadline - now_us()) / 1e3 + 1) < 0)
+            gaveup(what);
+    }
+}
+
+/* sendsig - Send the shell sig until it prints text; it misses a signal
+   sent before its job is in the job list. Returns when the one it took
+   was sent. */
+static double sendsig(int sig, char *text, char *what)
+{
+    double sent;
+    int tries;
+
+    for (tries = 0; tries < REPLYMS / RESENDMS; tries++) {
+        sent = now_us();
+        kill(shellpid, sig);
+        if (expect(text, RESENDMS) != NULL)
+            return sent;
+    }
+    gaveup(what);
+    return 0;
+}
+
+/* waitstate - Wait until a job is stopped, or no longer stopped */
+static void waitstate(pid_t pid, int stopped, char *what)
+{
+    struct timespec tick = { 0, 20000 };
+    char path[64], buf[256], *p;
+    double deadline = now_us() + REPLYMS * 1e3;
+    int fd, n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    while (now_us() < deadline) {
+        if ((fd = open(path, O_RDONLY)) < 0)
+            return;
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[n > 0 ? n : 0] = '\0';
+        if ((p = strrchr(buf, ')')) == NULL || (p[2] == 'T') == stopped)
+            return;
+        nanosleep(&tick, NULL);
+    }
+    gaveup(what);
+}
+
+/* stopbg - Stop a background job and let the shell catch up. tsh
+   prints the notice with its next command's output, so run one. */
+static void stopbg(pid_t pid, char *what)
+{
+    kill(pid, SIGTSTP);
+    waitstate(pid, 1, what);
+    sendcmd("jobs");
+    prompt_or_die(what);
+}
+
+/* nojobs - Ask for jobs until the shell lists none */
+static void nojobs(char *what)
+{
+    struct timespec tick = { 0, 100000 };
+    char *out;
+
+    for (;;) {
+        sendcmd("jobs");
+        if ((out = expect(prompt, REPLYMS)) == NULL)
+            gaveup(what);
+        if (memchr(out, '[', skipped) == NULL)
+            return;
+        nanosleep(&tick, NULL);
+    }
+}
+
+/*
+ * Workloads; each leaves nlat latencies in lat
+ */
+static void fgload(int count, char *cmd)
+{
+    double start;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        start = now_us();
+        sendcmd("%s", cmd);
+        if (expect(prompt, REPLYMS) == NULL) {
+            fprintf(stderr, "tshbench: shell exited after %d commands\n", i);
+            exit(1);
+        }
+        lat[nlat++] = now_us() - start;
+    }
+}
+
+static void burstload(int count, int burst)
+{
+    double start;
+    int i, n, done;
+
+    for (done = 0; done < count; done += n) {
+        n = count - done < burst ? count - done : burst;
+        nready = 0;
+        for (i = 0; i < n; i++) {
+            start = now_us();
+            sendcmd("%s -x %d &", self, (int) getpid());
+            prompt_or_die("burst launch");
+            lat[nlat++] = now_us() - start;
+        }
+        waitready(n, "burst ready");
+        for (i = 0; i < n; i++)
+            kill(ready[i], SIGUSR1);
+        nojobs("burst reap");
+    }
+}
+
+static void bgfgload(int count)
+{
+    double start;
+    pid_t pid;
+    int i;
+
+    nready = 0;
+    sendcmd("%s -x %d &", self, (int) getpid());
+    prompt_or_die("bgfg launch");
+    waitready(1, "bgfg ready");
+    pid = ready[0];
+    stopbg(pid, "bgfg stop");
+
+    for (i = 0; i + 1 < count; i += 2) {
+        start = now_us();
+        sendcmd("fg %%1");
+        waitstate(pid, 0, "bgfg fg");
+        sendsig(SIGTSTP, "stopped by signal", "bgfg ctrl-z");
+        prompt_or_die("bgfg ctrl-z");
+        lat[nlat++] = now_us() - start;
+
+        start = now_us();
+        sendcmd("bg %%1");
+        prompt_or_die("bgfg bg");
+        lat[nlat++] = now_us() - start;
+        waitstate(pid, 0, "bgfg bg");
+        stopbg(pid, "bgfg stop");
+    }
+    kill(pid, SIGKILL);
+    kill(pid, SIGCONT);
+    nojobs("bgfg reap");
+}
+
+static void signalload(int count)
+{
+    double sent;
+    int i;
+
+    for (i = 0; i + 1 < count; i += 2) {
+        nready = 0;
+        sendcmd("%s -x %d", self, (int) getpid());
+        waitready(1, "signals ready");
+
+        sent = sendsig(SIGTSTP, "stopped by signal", "signals ctrl-z");
+        prompt_or_die("signals ctrl-z");
+        lat[nlat++] = now_us() - sent;
+
+        sendcmd("fg %d", (int) ready[0]);
+        waitstate(ready[0], 0, "signals fg");
+        sent = sendsig(SIGINT, "terminated by signal", "signals ctrl-c");
+        prompt_or_die("signals ctrl-c");
+        lat[nlat++] = now_us() - sent;
+    }
+}
+
+/* reaplatency - From the trace ring, each -x job's time from saying it
+   was exiting to the shell deleting its job */
+static void reaplatency(char *tracefile)
+{
+    struct tracehdr_t *hdr;
+    struct tracerec_t *recs, *rec;
+    size_t size;
+    uint64_t i;
+    int fd, j;
+
+    size = sizeof(*hdr) + TRACERECS * sizeof(*recs);
+    if ((fd = open(tracefile, O_RDONLY)) < 0 ||
+        (hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(tracefile);
+        return;
+    }
+    close(fd);
+    if (memcmp(hdr->magic, "tshtrace", 8) != 0 || hdr->nrecs != TRACERECS) {
+        fprintf(stderr, "tshbench: %s didn't write a trace; try -N\n", shell);
+        munmap(hdr, size);
+        return;
+    }
+    recs = (struct tracerec_t *) (hdr + 1);
+    i = hdr->head > TRACERECS ? hdr->head - TRACERECS : 0;
+    for (; i < hdr->head; i++) {
+        rec = &recs[i % TRACERECS];
+        if (rec->type != TR_DELJOB)
+            continue;
+        for (j = 0; j < nexits; j++) {
+            if (exitpid[j] == rec->pid) {
+                reaplat[nreap++] = (rec->ns - exitns[j]) / 1e3;
+                exitpid[j] = 0;
+                break;
+            }
+        }
+    }
+    munmap(hdr, size);
+}
+
+/*
+ * Results
+ */
+static void latencies(char *what, double *v, int n)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += v[i];
+    qsort(v, n, sizeof(double), cmp_double);
+    printf("%s (us): min %.1f  p50 %.1f  p99 %.1f  max %.1f  mean %.1f\n",
+           what, v[0], v[n / 2], v[(n * 99) / 100], v[n - 1], total / n);
+}
+
+static void csvrow(FILE *csv, char *workload, double secs)
+{
+    time_t t = time(NULL);
+    char date[32];
+
+    if (ftell(csv) == 0)
+        fprintf(csv, "date,shell,args,workload,ops,secs,ops_per_sec,"
+                "p50_us,p99_us,max_us,reap_p50_us,reap_p99_us,reap_max_us\n");
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+    fprintf(csv, "%s,%s,%s,%s,%d,%.3f,%.0f,%.1f,%.1f,%.1f", date, shell,
+            shellargs ? shellargs : "", workload, nlat, secs, nlat / secs,
+            lat[nlat / 2], lat[(nlat * 99) / 100], lat[nlat - 1]);
+    if (nreap > 0)
+        fprintf(csv, ",%.1f,%.1f,%.1f\n", reaplat[nreap / 2],
+                reaplat[(nreap * 99) / 100], reaplat[nreap - 1]);
+    else
+        fprintf(csv, ",,,\n");
+    fflush(csv);
+}
+
+int main(int argc, char **argv)
+{
+    char *cmd = "/bin/true", *workloads = NULL, *csvfile = NULL;
+    char tracefile[] = "/tmp/tshbench-XXXXXX", *argp[6], *w, *list;
+    int c, i, count = 100, burst = 32, trace = 1, fd;
+    int to[2], from[2];
+    double start, secs;
+    FILE *csv = NULL;
+    ssize_t n;
+
+    while ((c = getopt(argc, argv, "hx:Ns:a:n:c:w:b:o:")) != EOF) {
+        switch (c) {
+        case 'x':
+            benchjob(atoi(optarg));
+            break;
+        case 'N':
+            trace = 0;
+            break;
+        case 's':
+            shell = optarg;
+            break;
+        case 'a':
+            shellargs = optarg;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'c':
+            cmd = optarg;
+            break;
+        case 'w':
+            workloads = strcmp(optarg, "all") ? optarg : "fg,burst,bgfg,signals";
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'o':
+            csvfile = optarg;
+            break;
+        default:
+            benchusage(argv[0]);
+        }
+    }
+    if (count < 2 || burst < 1)
+        benchusage(argv[0]);
+    if (workloads == NULL)
+        trace = 0;          /* plain prompt latency, as always */
+    if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0) {
+        perror("/proc/self/exe");
+        exit(1);
+    }
+    self[n] = '\0';
+    if (csvfile != NULL && (csv = fopen(csvfile, "a")) == NULL) {
+        perror(csvfile);
+        exit(1);
+    }
+
+    if (pipe(to) < 0 || pipe(from) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    i = 0;
+    argp[i++] = shell;
+    if (shellargs)
+        argp[i++] = shellargs;
+    if (trace) {
+        if ((fd = mkstemp(tracefile)) < 0) {
+            perror(tracefile);
+            exit(1);
+        }
+        close(fd);
+        argp[i++] = "-t";
+        argp[i++] = tracefile;
+    }
+    argp[i] = NULL;
+
+    if ((shellpid = fork()) == 0) {
+        dup2(to[0], 0);
+        dup2(from[1], 1);
+        close(to[0]);
+        close(to[1]);
+        close(from[0]);
+        close(from[1]);
+        execv(shell, argp);
+        perror(shell);
+        exit(1);
+    }
+    close(to[0]);
+    close(from[1]);
+    to_shell = to[1];
+    from_shell = from[0];
+
+    if ((lat = malloc(count * sizeof(double))) == NULL ||
+        (reaplat = malloc(count * sizeof(double))) == NULL ||
+        (ready = malloc((count > burst ? count : burst) * sizeof(pid_t))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (expect(prompt, REPLYMS) == NULL) {
+        fprintf(stderr, "%s: no prompt from %s (was it run with -p?)\n", argv[0], shell);
+        exit(1);
+    }
+
+    if (workloads == NULL) {
+        start = now_us();
+        fgload(count, cmd);
+        secs = (now_us() - start) / 1e6;
+        printf("%s: %d x \"%s\"\n", shell, count, cmd);
+        latencies("prompt latency", lat, nlat);
+        printf("throughput: %.0f commands/sec\n", count / secs);
+        if (csv)
+            csvrow(csv, "fg", secs);
+    }
+
+    list = strdup(workloads ? workloads : "");
+    for (w = strtok(list, ","); w != NULL; w = strtok(NULL, ",")) {
+        nlat = nreap = nexits = 0;
+        start = now_us();
+        if (strcmp(w, "fg") == 0) {
+            fgload(count, cmd);
+            printf("%s: fg: %d x \"%s\"\n", shell, count, cmd);
+        } else if (strcmp(w, "burst") == 0) {
+            burstload(count, burst);
+            printf("%s: burst: %d background jobs, %d at a time\n", shell, count, burst);
+        } else if (strcmp(w, "bgfg") == 0) {
+            bgfgload(count);
+            printf("%s: bgfg: %d x fg + ctrl-z, bg\n", shell, nlat / 2);
+        } else if (strcmp(w, "signals") == 0) {
+            signalload(count);
+            printf("%s: signals: %d x ctrl-z, fg, ctrl-c\n", shell, nlat / 2);
+        } else {
+            fprintf(stderr, "%s: unknown workload %s\n", argv[0], w);
+            benchusage(argv[0]);
+        }
+        secs = (now_us() - start) / 1e6;
+        latencies(strcmp(w, "burst") == 0 ? "launch latency" :
+                  strcmp(w, "signals") == 0 ? "signal latency" : "prompt latency", lat, nlat);
+        if (trace && nexits > 0) {
+            reaplatency(tracefile);
+            if (nreap > 0)
+                latencies("reap latency", reaplat, nreap);
+        }
+        printf("throughput: %.0f ops/sec\n", nlat / secs);
+        if (csv)
+            csvrow(csv, w, secs);
+    }
+
+    killjobs();
+    close(to_shell);
+    waitpid(shellpid, NULL, 0);
+    if (trace)
+        unlink(tracefile);
+    exit(0);
+}
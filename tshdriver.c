@@ -0,0 +1,1338 @@
+/*
+ * tshdriver.c - Trace-driven shell driver
+ *
+ * usage: tshdriver [-hvgVPT] -t <trace> -s <shell> [-a <args>]
+ *        tshdriver [-vVPT] [-j <n>] -o <dir> -s <shell>... [-a <args>] <trace>...
+ *
+ * The C version of sdriver.pl, and a drop-in for it: the same options,
+ * the same trace directives (TSTP, INT, QUIT, KILL, CLOSE, WAIT, SLEEP,
+ * WAITOUTPUT, WAITJOBS; see sdriver.pl), and by default the same output,
+ * the trace's comments as they go by and then everything the shell
+ * wrote, so checktsh.pl compares it with sdriver.pl's as it is.
+ *
+ * Where sdriver.pl writes the whole trace and reads afterwards, this
+ * driver polls the shell's output all along and keeps it as it comes.
+ * With -T it prints it that way too: comments, driver messages and shell
+ * output in the order they happened, each line stamped with the
+ * milliseconds since the shell started.
+ *
+ * With -P the shell runs on a pseudo-terminal of its own instead of
+ * pipes. It is then a session leader with a controlling terminal, as
+ * under a login, so "ps T" shows just the processes of its trace. The
+ * terminal neither echoes nor translates, CLOSE sends it end of file,
+ * and the shell's stderr goes to it as well.
+ *
+ * With -o every trace runs against every -s shell, all from this one
+ * process (at most <n> shells at a time with -j), and each output goes
+ * to <dir>/<trace>.<shell>.out, e.g. out/trace01.tsh.out.
+ *
+ * WAITOUTPUT takes a POSIX extended regex plus Perl's \d, \s and \w,
+ * which covers what the traces use. -V runs in virtual time like
+ * sdriver.pl -V (see vclock.h).
+ */
+#define _GNU_SOURCE       /* for pipe2, mkostemp */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <regex.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+
+#define MAXLINE    8192   /* max trace line */
+#define MAXARGS      32   /* max shell arguments */
+#define MAXSHELLS    16   /* max -s shells */
+#define MAXTEMPS     16   /* max TEMPFILEn names in a trace */
+#define WAITLIMIT  10.0   /* seconds before a WAIT* directive gives up */
+#define LOOK      0.001   /* seconds between looks at /proc while settling */
+#define JOBSPOLL  0.005   /* seconds between looks for WAITJOBS */
+#define VFOREVER 1000000000000000LL /* virtual time that wakes every sleeper */
+#define FOREVER   1e300
+
+/* Session states: what a session is waiting for */
+#define S_START  0 /* the shell to start up and wait for input */
+#define S_RUN    1 /* nothing: on with the trace */
+#define S_SLEEP  2 /* SLEEP: the deadline */
+#define S_VSLEEP 3 /* SLEEP in virtual time: the clock to reach vtarget */
+#define S_SIGNAL 4 /* signal in virtual time: the processes to settle first */
+#define S_OUTPUT 5 /* WAITOUTPUT: the pattern */
+#define S_JOBS   6 /* WAITJOBS: the shell's children */
+#define S_WAIT   7 /* WAIT: the shell to exit */
+#define S_DRAIN  8 /* end of trace: end of the shell's output */
+#define S_REAP   9 /* end of trace: the shell to exit */
+#define S_LINGER 10 /* end of trace, virtual time: its processes to go */
+#define S_DONE  11 /* finished */
+
+struct session_t {          /* One trace run against one shell */
+    char *trace;            /* trace file */
+    char *shell;            /* shell program */
+    FILE *tf;               /* the trace, as far as we've got */
+    FILE *log;              /* where comments and shell output go */
+    char line[MAXLINE];     /* current trace line */
+    int state;              /* S_* */
+    pid_t pid;              /* the shell */
+    int rfd, wfd;           /* shell's output and input, -1 once closed */
+    int eof;                /* shell's output has ended */
+    int reaped;             /* shell has been waited for */
+    char eofchar;           /* -P: what ends the terminal's input */
+    char *out;              /* everything the shell wrote, NUL-terminated */
+    size_t outlen, outsize; /* its length and allocated size */
+    size_t outmark;         /* WAITOUTPUT matches only what comes after this */
+    size_t outshown;        /* -T: how much of out has been printed */
+    double start;           /* when the shell started */
+    double wake;            /* when it next needs a look, FOREVER for events */
+    double deadline;        /* when the current wait gives up */
+    char *pattern;          /* WAITOUTPUT: the pattern as written */
+    regex_t re;             /* WAITOUTPUT: and compiled */
+    int jobstate, njobs;    /* WAITJOBS: state (jobnames index) and count */
+    int sig;                /* S_SIGNAL: the signal to send */
+    char clockpath[64];     /* -V: the clock file */
+    int clockfd;            /* -V: and open */
+    long long vnow;         /* -V: virtual time in ms */
+    long long vtarget;      /* -V: where the current sleep ends */
+    int drains;             /* -V: virtual steps taken at end of trace */
+    int hungup;             /* -V: hangup has been done */
+    int settling, looks;    /* -V: settling, and quiet looks in a row */
+    double lastlook;        /* -V: when we last looked */
+    double settledeadline;  /* -V: when settling gives up */
+    pid_t *tracked;         /* -V: the shell and everything it started */
+    int ntracked, trackedsize;
+    char tempkey[MAXTEMPS][32];  /* TEMPFILEn placeholders seen */
+    char tempname[MAXTEMPS][64]; /* and the files made for them */
+    int ntemps;
+};
+
+struct proc_t {             /* One process from /proc */
+    pid_t pid, ppid;
+    char state;             /* R, S, D, T, Z, ... */
+};
+
+/* Global variables */
+char *progname;             /* argv[0] */
+int verbose = 0;            /* -v: say what the driver is doing */
+int grade = 0;              /* -g: print the shell's pid for the autograder */
+int vtime = 0;              /* -V: virtual time */
+int usepty = 0;             /* -P: run shells on a pseudo-terminal */
+int stamps = 0;             /* -T: timestamped output as it comes */
+char *outdir = NULL;        /* -o: many traces, outputs here */
+int chldpipe[2];            /* SIGCHLD handler -> poll */
+
+struct proc_t *procs;       /* the last scan of /proc, by pid */
+int nprocs, procsize;
+int procsfresh = 0;         /* procs is from this turn of the main loop */
+
+char *jobnames[] = { "running", "stopped", "none" };
+
+/* Function prototypes */
+void startshell(struct session_t *s, char *args);
+void advance(struct session_t *s);
+void doline(struct session_t *s);
+void readshell(struct session_t *s);
+void reapshells(struct session_t *sessions, int n);
+void finish(struct session_t *s);
+void closeinput(struct session_t *s);
+void tempfiles(struct session_t *s, char *line, char *cmd, size_t size);
+int waitjobs(char *line, int *state, int *n);
+void perlre(char *pattern, char *re, size_t size);
+void showoutput(struct session_t *s, int all);
+
+void scanprocs(void);
+struct proc_t *findproc(pid_t pid);
+int started(struct session_t *s);
+int jobsreached(struct session_t *s);
+int quiet(struct session_t *s);
+int lingering(struct session_t *s);
+void hangup(struct session_t *s);
+int settle(struct session_t *s);
+int vstep(struct session_t *s);
+long long nextwake(struct session_t *s);
+void setclock(struct session_t *s);
+
+void sigchld_handler(int sig);
+double now(void);
+void writeall(int fd, char *buf, size_t len);
+void say(struct session_t *s, char *fmt, ...);
+void note(struct session_t *s, char *fmt, ...);
+void complain(struct session_t *s, char *fmt, ...);
+void fatal(char *fmt, ...);
+void usage(void);
+
+/*
+ * main - Check the arguments, then run every session to the end
+ */
+int main(int argc, char **argv)
+{
+    char *trace = NULL, *args = "", *shells[MAXSHELLS], **traces;
+    struct session_t *sessions, *s, **who;
+    struct pollfd *pfd;
+    struct sigaction sa;
+    int c, i, j, n, ntraces, nshells = 0, jobs = 0;
+    int next, running, done, npoll, timeout;
+    double wake;
+    char buf[64];
+
+    progname = argv[0];
+    while ((c = getopt(argc, argv, "hvgVPTt:s:a:o:j:")) != EOF) {
+	switch (c) {
+	case 'v':
+	    verbose = 1;
+	    break;
+	case 'g':
+	    grade = 1;
+	    break;
+	case 'V':
+	    vtime = 1;
+	    break;
+	case 'P':
+	    usepty = 1;
+	    break;
+	case 'T':
+	    stamps = 1;
+	    break;
+	case 't':
+	    trace = optarg;
+	    break;
+	case 's':
+	    if (nshells == MAXSHELLS)
+		fatal("ERROR: at most %d shells", MAXSHELLS);
+	    shells[nshells++] = optarg;
+	    break;
+	case 'a':
+	    args = optarg;
+	    break;
+	case 'o':
+	    outdir = optarg;
+	    break;
+	case 'j':
+	    jobs = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+
+    /* One trace and one shell, or with -o any number of each */
+    ntraces = argc - optind + (trace != NULL);
+    if ((traces = malloc((ntraces + 1) * sizeof(char *))) == NULL)
+	fatal("malloc");
+    n = 0;
+    if (trace != NULL)
+	traces[n++] = trace;
+    while (optind < argc)
+	traces[n++] = argv[optind++];
+    if (ntraces == 0)
+	fatal("Missing required -t argument");
+    if (nshells == 0)
+	fatal("Missing required -s argument");
+    if (outdir == NULL && (ntraces > 1 || nshells > 1))
+	fatal("ERROR: more than one trace or shell needs -o <dir>");
+    for (i = 0; i < ntraces; i++) {
+	if (access(traces[i], F_OK) < 0)
+	    fatal("ERROR: %s not found", traces[i]);
+	if (access(traces[i], R_OK) < 0)
+	    fatal("ERROR: %s is not readable", traces[i]);
+    }
+    for (i = 0; i < nshells; i++) {
+	if (access(shells[i], F_OK) < 0)
+	    fatal("ERROR: %s not found", shells[i]);
+	if (access(shells[i], X_OK) < 0)
+	    fatal("ERROR: %s is not executable", shells[i]);
+    }
+    if (outdir != NULL && mkdir(outdir, 0777) < 0 && errno != EEXIST)
+	fatal("ERROR: Couldn't create %s: %s", outdir, strerror(errno));
+
+    n = ntraces * nshells;
+    if (jobs <= 0 || jobs > n)
+	jobs = n;
+    if ((sessions = calloc(n, sizeof(*sessions))) == NULL ||
+	(pfd = malloc((n + 1) * sizeof(*pfd))) == NULL ||
+	(who = malloc(n * sizeof(*who))) == NULL)
+	fatal("malloc");
+    for (i = 0; i < ntraces; i++) {
+	for (j = 0; j < nshells; j++) {
+	    s = &sessions[i * nshells + j];
+	    s->trace = traces[i];
+	    s->shell = shells[j];
+	    s->rfd = s->wfd = s->clockfd = -1;
+	}
+    }
+
+    /* SIGCHLD wakes the poll below through a pipe */
+    if (pipe2(chldpipe, O_CLOEXEC | O_NONBLOCK) < 0)
+	fatal("pipe: %s", strerror(errno));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* In virtual time S_LINGER waits for the jobs a shell leaves behind
+       to be reaped. Adopt them, so that is up to us and not to an init
+       that may be slow about it (see hangup for the catch). */
+    if (vtime)
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    next = running = done = 0;
+    while (done < n) {
+	while (next < n && running < jobs) {
+	    startshell(&sessions[next++], args);
+	    running++;
+	}
+
+	/* Take every session as far as it goes, then sleep until one of
+	   them has output, a shell exits, or a timer is up */
+	procsfresh = 0;
+	wake = FOREVER;
+	npoll = 0;
+	for (i = 0; i < next; i++) {
+	    s = &sessions[i];
+	    if (s->state == S_DONE)
+		continue;
+	    advance(s);
+	    if (s->state == S_DONE) {
+		running--;
+		done++;
+		continue;
+	    }
+	    if (s->rfd >= 0) {
+		pfd[npoll].fd = s->rfd;
+		pfd[npoll].events = POLLIN;
+		who[npoll++] = s;
+	    }
+	    if (s->wake < wake)
+		wake = s->wake;
+	}
+	if (done == n || (next < n && running < jobs))
+	    continue;
+
+	pfd[npoll].fd = chldpipe[0];
+	pfd[npoll].events = POLLIN;
+	timeout = -1;
+	if (wake < FOREVER) {
+	    wake -= now();
+	    timeout = wake > 0 ? (int) (wake * 1e3) + 1 : 0;
+	}
+	if (poll(pfd, npoll + 1, timeout) < 0 && errno != EINTR)
+	    fatal("poll: %s", strerror(errno));
+	for (i = 0; i < npoll; i++) {
+	    if (pfd[i].revents)
+		readshell(who[i]);
+	}
+	while (read(chldpipe[0], buf, sizeof(buf)) > 0)
+	    ;
+	reapshells(sessions, next);
+    }
+    exit(0);
+}
+
+/*****************
+ * Running a trace
+ *****************/
+
+/*
+ * startshell - Open a session's files and start its shell
+ */
+void startshell(struct session_t *s, char *args)
+{
+    char *argv[MAXARGS + 2], argbuf[MAXLINE], path[MAXLINE], *tmpdir, *p;
+    int argc, in[2], out[2], slave = -1;
+    struct termios t;
+
+    if ((s->tf = fopen(s->trace, "re")) == NULL)
+	fatal("ERROR: Couldn't open input file %s: %s", s->trace, strerror(errno));
+    if (outdir == NULL) {
+	s->log = stdout;
+    } else {
+	p = strrchr(s->trace, '/');
+	snprintf(path, sizeof(path), "%s/%.*s.%s.out", outdir,
+		 (int) strcspn(p ? p + 1 : s->trace, "."), p ? p + 1 : s->trace,
+		 strrchr(s->shell, '/') ? strrchr(s->shell, '/') + 1 : s->shell);
+	if ((s->log = fopen(path, "we")) == NULL)
+	    fatal("ERROR: Couldn't open %s: %s", path, strerror(errno));
+    }
+
+    s->outsize = 4096;
+    if ((s->out = malloc(s->outsize)) == NULL)
+	fatal("malloc");
+    s->out[0] = '\0';
+
+    /* "shell args" is run the way Perl runs it: split at whitespace */
+    argc = 0;
+    argv[argc++] = s->shell;
+    snprintf(argbuf, sizeof(argbuf), "%s", args);
+    for (p = strtok(argbuf, " \t\n"); p != NULL && argc <= MAXARGS; p = strtok(NULL, " \t\n"))
+	argv[argc++] = p;
+    argv[argc] = NULL;
+
+    /* The virtual clock, which everything the shell runs inherits */
+    if (vtime) {
+	tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	snprintf(s->clockpath, sizeof(s->clockpath), "%s/tshclock-XXXXXX", tmpdir);
+	if ((s->clockfd = mkostemp(s->clockpath, O_CLOEXEC)) < 0)
+	    fatal("ERROR: Couldn't create %s: %s", s->clockpath, strerror(errno));
+	s->vnow = 0;
+	setclock(s);
+    }
+
+    if (usepty) {
+	/* Set the terminal up before the shell can write to it: with echo
+	   on, what we send would come back as output */
+	if ((s->rfd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+	    grantpt(s->rfd) < 0 || unlockpt(s->rfd) < 0 ||
+	    (slave = open(ptsname(s->rfd), O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+	    tcgetattr(slave, &t) < 0)
+	    fatal("ERROR: Couldn't make a pseudo-terminal: %s", strerror(errno));
+	t.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHONL | ISIG | IEXTEN);
+	t.c_oflag &= ~OPOST;
+	if (tcsetattr(slave, TCSANOW, &t) < 0)
+	    fatal("ERROR: Couldn't set up the pseudo-terminal: %s", strerror(errno));
+	s->eofchar = t.c_cc[VEOF];
+	s->wfd = s->rfd;
+    } else {
+	if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+	    fatal("pipe: %s", strerror(errno));
+	s->wfd = in[1];
+	s->rfd = out[0];
+    }
+
+    s->start = now();
+    s->deadline = s->start + WAITLIMIT;
+    s->state = S_START;
+    if ((s->pid = fork()) < 0)
+	fatal("fork: %s", strerror(errno));
+    if (s->pid == 0) {
+	if (usepty) {
+	    setsid();
+	    ioctl(slave, TIOCSCTTY, 0);
+	    dup2(slave, 0);
+	    dup2(slave, 1);
+	    dup2(slave, 2);
+	} else {
+	    dup2(in[0], 0);
+	    dup2(out[1], 1);
+	}
+	if (vtime)
+	    setenv("TSH_VCLOCK", s->clockpath, 1);
+	signal(SIGPIPE, SIG_DFL); /* an ignored signal stays ignored across exec */
+	execvp(argv[0], argv);
+	fprintf(stderr, "%s: Couldn't run %s: %s\n", progname, s->shell, strerror(errno));
+	_exit(127);
+    }
+    if (usepty) {
+	close(slave);
+    } else {
+	close(in[0]);
+	close(out[1]);
+    }
+
+    /* The autograder will want to know the child shell's pid */
+    if (grade)
+	say(s, "pid=%d", s->pid);
+}
+
+/*
+ * advance - Take a session as far as it can go, and set s->wake to when
+ *     it next needs a look if no output or SIGCHLD comes first
+ */
+void advance(struct session_t *s)
+{
+    regmatch_t m;
+    long long next;
+    double t;
+
+    for (;;) {
+	t = now();
+	s->wake = FOREVER;
+	switch (s->state) {
+	case S_START:
+	    /* Commands sent while the shell is still starting up make its
+	       first fork race the child's exec (tshref then fails its
+	       setpgid); sdriver.pl is never that quick off the mark */
+	    if (!started(s) && !s->reaped && t < s->deadline) {
+		s->wake = t + LOOK;
+		return;
+	    }
+	    s->state = S_RUN;
+	    break;
+
+	case S_RUN:
+	    if (fgets(s->line, sizeof(s->line), s->tf) != NULL) {
+		s->line[strcspn(s->line, "\n")] = '\0';
+		doline(s);
+		break;
+	    }
+
+	    /* End of the trace: the shell gets end of file, and what it
+	       writes from here on is all read before it's reaped */
+	    closeinput(s);
+	    note(s, "Reading data from child %d", s->pid);
+	    s->state = S_DRAIN;
+	    break;
+
+	case S_SLEEP:
+	    if (t < s->deadline) {
+		s->wake = s->deadline;
+		return;
+	    }
+	    s->state = S_RUN;
+	    break;
+
+	case S_VSLEEP:
+	    if (!vstep(s))
+		return;
+	    s->state = S_RUN;
+	    break;
+
+	case S_SIGNAL:
+	    if (!settle(s))
+		return;
+	    kill(s->pid, s->sig);
+	    procsfresh = 0;
+	    s->state = S_RUN;
+	    break;
+
+	case S_OUTPUT:
+	    if (regexec(&s->re, s->out + s->outmark, 1, &m, s->outmark ? REG_NOTBOL : 0) == 0) {
+		s->outmark += m.rm_eo;
+	    } else if (t >= s->deadline || s->eof) {
+		complain(s, "WAITOUTPUT %s: gave up", s->pattern);
+		s->outmark = s->outlen;
+	    } else {
+		s->wake = s->deadline;
+		return;
+	    }
+	    regfree(&s->re);
+	    free(s->pattern);
+	    s->state = S_RUN;
+	    break;
+
+	case S_JOBS:
+	    if (!jobsreached(s)) {
+		if (t < s->deadline) {
+		    s->wake = t + JOBSPOLL;
+		    return;
+		}
+		complain(s, "WAITJOBS %s %d: gave up", jobnames[s->jobstate], s->njobs);
+	    }
+	    s->state = S_RUN;
+	    break;
+
+	case S_WAIT:
+	    if (!s->reaped)
+		return;
+	    note(s, "Child %d reaped", s->pid);
+	    s->state = S_RUN;
+	    break;
+
+	case S_DRAIN:
+	    /* In virtual time the clock runs from one sleeper's deadline to
+	       the next until the shell and its jobs are done with the
+	       output, then lets anything still asleep go */
+	    if (vtime && !s->eof && s->drains < 10000) {
+		if (!settle(s))
+		    return;
+		if (!s->eof && (next = nextwake(s)) < VFOREVER) {
+		    s->vnow = next;
+		    setclock(s);
+		    s->drains++;
+		    break;
+		}
+	    }
+	    if (vtime && s->vnow < VFOREVER) {
+		s->vnow = VFOREVER;
+		setclock(s);
+	    }
+	    if (!s->eof) {
+		/* A stopped job can hold the output open */
+		if (s->reaped)
+		    hangup(s);
+		return;
+	    }
+	    s->state = S_REAP;
+	    break;
+
+	case S_REAP:
+	    if (!s->reaped)
+		return;
+	    hangup(s);
+	    s->state = S_LINGER;
+	    s->deadline = t + WAITLIMIT;
+	    break;
+
+	case S_LINGER:
+	    /* In virtual time the next trace can start a moment later, so
+	       don't leave it our processes, or their zombies */
+	    if (vtime && lingering(s) && t < s->deadline) {
+		s->wake = t + JOBSPOLL;
+		return;
+	    }
+	    finish(s);
+	    return;
+
+	case S_DONE:
+	    return;
+	}
+    }
+}
+
+/*
+ * doline - Carry out the trace line in s->line, or start waiting as it says
+ */
+void doline(struct session_t *s)
+{
+    static struct {
+	char *name;
+	int sig;
+    } sigs[] = { { "TSTP", SIGTSTP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL } };
+    char *line = s->line, *p, cmd[MAXLINE + 1], err[MAXLINE];
+    double secs;
+    int i, rc;
+
+    /* Comment line */
+    if (line[0] == '#') {
+	say(s, "%s", line);
+	return;
+    }
+
+    /* Blank line */
+    if (line[strspn(line, " \t\r\f\v")] == '\0') {
+	note(s, "Ignoring blank line");
+	return;
+    }
+
+    /* Wait for the shell to print something */
+    if (strncmp(line, "WAITOUTPUT ", 11) == 0) {
+	note(s, "Waiting for output matching /%s/", line + 11);
+	s->pattern = strdup(line + 11);
+	perlre(line + 11, cmd, sizeof(cmd));
+	if ((rc = regcomp(&s->re, cmd, REG_EXTENDED | REG_NEWLINE)) != 0) {
+	    regerror(rc, &s->re, err, sizeof(err));
+	    complain(s, "WAITOUTPUT %s: %s", s->pattern, err);
+	    free(s->pattern);
+	    return;
+	}
+	s->deadline = now() + WAITLIMIT;
+	s->state = S_OUTPUT;
+	return;
+    }
+
+    /* Wait for the shell's jobs to get somewhere */
+    if (waitjobs(line, &s->jobstate, &s->njobs)) {
+	note(s, "Waiting for %d %s child processes", s->njobs, jobnames[s->jobstate]);
+	s->deadline = now() + WAITLIMIT;
+	s->state = S_JOBS;
+	return;
+    }
+
+    /* Send SIGTSTP, SIGINT, SIGQUIT or SIGKILL; like sdriver.pl, the
+       name anywhere in the line will do */
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+	if (strstr(line, sigs[i].name) != NULL) {
+	    note(s, "Sending SIG%s signal to process %d", sigs[i].name, s->pid);
+	    s->sig = sigs[i].sig;
+	    s->state = S_SIGNAL;
+	    if (!vtime) {
+		kill(s->pid, s->sig);
+		s->state = S_RUN;
+	    }
+	    return;
+	}
+    }
+
+    /* Close pipe (sends EOF notification to child) */
+    if (strstr(line, "CLOSE") != NULL) {
+	note(s, "Closing output end of pipe to child %d", s->pid);
+	closeinput(s);
+	return;
+    }
+
+    /* Wait for child to terminate */
+    if (strstr(line, "WAIT") != NULL) {
+	note(s, "Waiting for child %d", s->pid);
+	s->state = S_WAIT;
+	return;
+    }
+
+    /* Sleep */
+    if ((p = strstr(line, "SLEEP ")) != NULL && isdigit((unsigned char) p[6])) {
+	secs = strtod(p + 6, NULL);
+	note(s, "Sleeping %g secs", secs);
+	if (vtime) {
+	    s->vtarget = s->vnow + (long long) (secs * 1000 + 0.5);
+	    s->state = S_VSLEEP;
+	} else {
+	    s->deadline = now() + secs;
+	    s->state = S_SLEEP;
+	}
+	return;
+    }
+
+    /* Anything else is for the shell */
+    tempfiles(s, line, cmd, sizeof(cmd) - 1);
+    note(s, "Sending :%s: to child %d", cmd, s->pid);
+    strcat(cmd, "\n");
+    if (s->wfd >= 0)
+	writeall(s->wfd, cmd, strlen(cmd));
+}
+
+/*
+ * readshell - Read what the shell has written, or note that it is done
+ */
+void readshell(struct session_t *s)
+{
+    char buf[4096];
+    ssize_t n;
+
+    if ((n = read(s->rfd, buf, sizeof(buf))) > 0) {
+	if (s->outlen + n + 1 > s->outsize) {
+	    s->outsize = (s->outlen + n + 1) * 2;
+	    if ((s->out = realloc(s->out, s->outsize)) == NULL)
+		fatal("realloc");
+	}
+	memcpy(s->out + s->outlen, buf, n);
+	s->outlen += n;
+	s->out[s->outlen] = '\0';
+	if (stamps)
+	    showoutput(s, 0);
+	return;
+    }
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+	return;
+
+    /* End of file; a pseudo-terminal says EIO once the last process
+       with it open has gone */
+    s->eof = 1;
+    close(s->rfd);
+    if (s->wfd == s->rfd)
+	s->wfd = -1;
+    s->rfd = -1;
+}
+
+/*
+ * reapshells - Wait for whichever shells have exited
+ */
+void reapshells(struct session_t *sessions, int n)
+{
+    pid_t pid;
+    int i;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+	for (i = 0; i < n; i++) {
+	    if (sessions[i].pid == pid)
+		sessions[i].reaped = 1;
+	}
+    }
+}
+
+/*
+ * finish - Print what the shell wrote and clean up after the session
+ */
+void finish(struct session_t *s)
+{
+    int i;
+
+    if (stamps)
+	showoutput(s, 1);
+    else
+	fwrite(s->out, 1, s->outlen, s->log);
+
+    for (i = 0; i < s->ntemps; i++) {
+	note(s, "Unlinking %s", s->tempname[i]);
+	unlink(s->tempname[i]);
+    }
+    if (s->clockfd >= 0) {
+	close(s->clockfd);
+	unlink(s->clockpath);
+    }
+    note(s, "Shell terminated");
+
+    fclose(s->tf);
+    if (s->log != stdout) {
+	fclose(s->log);
+	printf("%-16s %-12s %8.2fs\n", s->trace, s->shell, now() - s->start);
+	fflush(stdout);
+    } else {
+	fflush(s->log);
+    }
+    free(s->out);
+    free(s->tracked);
+    s->state = S_DONE;
+}
+
+/*
+ * closeinput - Give the shell end of file, the way CLOSE does
+ */
+void closeinput(struct session_t *s)
+{
+    if (s->wfd < 0)
+	return;
+    if (usepty)
+	writeall(s->wfd, &s->eofchar, 1);
+    else
+	close(s->wfd);
+    s->wfd = -1;
+}
+
+/*
+ * tempfiles - Copy line to cmd with each TEMPFILEn replaced by the name
+ *     of a file (made the first time n comes up) that holds its own name
+ */
+void tempfiles(struct session_t *s, char *line, char *cmd, size_t size)
+{
+    char *p, *q;
+    size_t n = 0;
+    int i, fd;
+
+    for (p = line; *p != '\0' && n < size - 1; ) {
+	if (strncmp(p, "TEMPFILE", 8) != 0 || !isdigit((unsigned char) p[8])) {
+	    cmd[n++] = *p++;
+	    continue;
+	}
+	for (q = p + 8; isdigit((unsigned char) *q); q++)
+	    ;
+	for (i = 0; i < s->ntemps; i++) {
+	    if (strncmp(s->tempkey[i], p, q - p) == 0 && s->tempkey[i][q - p] == '\0')
+		break;
+	}
+	if (i == s->ntemps) {
+	    if (i == MAXTEMPS || q - p >= sizeof(s->tempkey[i]))
+		fatal("ERROR: too many TEMPFILEs in %s", s->trace);
+	    snprintf(s->tempkey[i], sizeof(s->tempkey[i]), "%.*s", (int) (q - p), p);
+	    snprintf(s->tempname[i], sizeof(s->tempname[i]), "tshtmp-%s-XXXXXX", s->tempkey[i] + 8);
+	    if ((fd = mkostemp(s->tempname[i], O_CLOEXEC)) < 0)
+		fatal("ERROR: Couldn't create %s: %s", s->tempname[i], strerror(errno));
+	    dprintf(fd, "%s\n", s->tempname[i]);
+	    close(fd);
+	    note(s, "Created %s as %s", s->tempkey[i], s->tempname[i]);
+	    s->ntemps++;
+	}
+	n += snprintf(cmd + n, size - n, "%s", s->tempname[i]);
+	if (n >= size)
+	    n = size - 1;
+	p = q;
+    }
+    cmd[n] = '\0';
+}
+
+/*
+ * waitjobs - Parse "WAITJOBS running|stopped|none [<n>]". Returns 0 if
+ *     line isn't one, and sdriver.pl then takes it for a WAIT.
+ */
+int waitjobs(char *line, int *state, int *n)
+{
+    char *p;
+    int i, len;
+
+    if (strncmp(line, "WAITJOBS ", 9) != 0)
+	return 0;
+    p = line + 9;
+    for (i = 0; i < 3; i++) {
+	len = strlen(jobnames[i]);
+	if (strncmp(p, jobnames[i], len) == 0)
+	    break;
+    }
+    if (i == 3)
+	return 0;
+    p += len;
+    *state = i;
+    *n = 1;
+    if (*p == ' ' && isdigit((unsigned char) p[1]))
+	*n = strtol(p + 1, &p, 10);
+    while (isspace((unsigned char) *p))
+	p++;
+    return *p == '\0';
+}
+
+/*
+ * perlre - Turn Perl's \d, \s and \w (and \D, \S, \W) in a WAITOUTPUT
+ *     pattern into POSIX classes; the rest is the same in both
+ */
+void perlre(char *pattern, char *re, size_t size)
+{
+    char *class;
+    size_t n = 0;
+
+    for (; *pattern != '\0' && n < size - 1; pattern++) {
+	class = NULL;
+	if (pattern[0] == '\\') {
+	    switch (pattern[1]) {
+	    case 'd': class = "[0-9]"; break;
+	    case 'D': class = "[^0-9]"; break;
+	    case 's': class = "[[:space:]]"; break;
+	    case 'S': class = "[^[:space:]]"; break;
+	    case 'w': class = "[[:alnum:]_]"; break;
+	    case 'W': class = "[^[:alnum:]_]"; break;
+	    }
+	}
+	if (class == NULL) {
+	    re[n++] = *pattern;
+	    if (pattern[0] == '\\' && pattern[1] != '\0' && n < size - 1)
+		re[n++] = *++pattern;
+	    continue;
+	}
+	n += snprintf(re + n, size - n, "%s", class);
+	if (n >= size)
+	    n = size - 1;
+	pattern++;
+    }
+    re[n] = '\0';
+}
+
+/*
+ * showoutput - -T: print the shell's new lines, stamped; with all, a
+ *     last line without a newline too
+ */
+void showoutput(struct session_t *s, int all)
+{
+    char *nl;
+    size_t len;
+
+    while (s->outshown < s->outlen) {
+	nl = memchr(s->out + s->outshown, '\n', s->outlen - s->outshown);
+	if (nl == NULL && !all)
+	    return;
+	len = nl ? nl - (s->out + s->outshown) : s->outlen - s->outshown;
+	say(s, "%.*s", (int) len, s->out + s->outshown);
+	s->outshown += len + (nl != NULL);
+    }
+}
+
+/************************************
+ * Watching processes, virtual time
+ ************************************/
+
+static int cmpproc(const void *a, const void *b)
+{
+    return ((struct proc_t *) a)->pid - ((struct proc_t *) b)->pid;
+}
+
+/*
+ * scanprocs - Read every process's state and parent from /proc, once
+ *     per turn of the main loop
+ */
+void scanprocs(void)
+{
+    char path[300], buf[512], *p;
+    struct dirent *de;
+    struct proc_t *pr;
+    DIR *dir;
+    int fd;
+    ssize_t n;
+
+    if (procsfresh)
+	return;
+    if ((dir = opendir("/proc")) == NULL)
+	fatal("ERROR: Couldn't read /proc: %s", strerror(errno));
+    nprocs = 0;
+    while ((de = readdir(dir)) != NULL) {
+	if (!isdigit((unsigned char) de->d_name[0]))
+	    continue;
+	snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	    continue;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+	    continue;
+	buf[n] = '\0';
+
+	/* pid (comm) state ppid ...; comm may hold spaces and parens */
+	if ((p = strrchr(buf, ')')) == NULL)
+	    continue;
+	if (nprocs == procsize) {
+	    procsize = procsize ? procsize * 2 : 256;
+	    if ((procs = realloc(procs, procsize * sizeof(*procs))) == NULL)
+		fatal("realloc");
+	}
+	pr = &procs[nprocs];
+	pr->pid = atoi(buf);
+	if (sscanf(p + 1, " %c %d", &pr->state, &pr->ppid) == 2)
+	    nprocs++;
+    }
+    closedir(dir);
+    qsort(procs, nprocs, sizeof(*procs), cmpproc);
+    procsfresh = 1;
+}
+
+/*
+ * findproc - A process from the last scan, or NULL if it was gone
+ */
+struct proc_t *findproc(pid_t pid)
+{
+    struct proc_t key;
+
+    key.pid = pid;
+    return bsearch(&key, procs, nprocs, sizeof(*procs), cmpproc);
+}
+
+/*
+ * started - True once the shell has exec'd and is blocked, waiting for
+ *     its first command
+ */
+int started(struct session_t *s)
+{
+    static char self[MAXLINE];
+    char path[64], exe[MAXLINE];
+    struct proc_t *pr;
+    ssize_t n;
+
+    if (self[0] == '\0' && (n = readlink("/proc/self/exe", self, sizeof(self) - 1)) > 0)
+	self[n] = '\0';
+    snprintf(path, sizeof(path), "/proc/%d/exe", s->pid);
+    n = readlink(path, exe, sizeof(exe) - 1);
+    exe[n > 0 ? n : 0] = '\0';
+    scanprocs();
+    return strcmp(exe, self) != 0 && (pr = findproc(s->pid)) != NULL &&
+	pr->state != 'R' && pr->state != 'D';
+}
+
+/*
+ * jobsreached - True if the shell's children that have exec'd match the
+ *     session's WAITJOBS
+ */
+int jobsreached(struct session_t *s)
+{
+    char path[64], shellexe[MAXLINE], exe[MAXLINE];
+    ssize_t n;
+    int i, count = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/exe", s->pid);
+    n = readlink(path, shellexe, sizeof(shellexe) - 1);
+    shellexe[n > 0 ? n : 0] = '\0';
+    scanprocs();
+    for (i = 0; i < nprocs; i++) {
+	if (procs[i].ppid != s->pid)
+	    continue;
+	snprintf(path, sizeof(path), "/proc/%d/exe", procs[i].pid);
+	n = readlink(path, exe, sizeof(exe) - 1);
+	exe[n > 0 ? n : 0] = '\0';
+	if (strcmp(exe, shellexe) == 0)
+	    continue;
+	if (s->jobstate == 2 || (s->jobstate == 1) == (procs[i].state == 'T'))
+	    count++;
+    }
+    return s->jobstate == 2 ? count == 0 : count >= s->njobs;
+}
+
+static int tracking(struct session_t *s, pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < s->ntracked; i++) {
+	if (s->tracked[i] == pid)
+	    return 1;
+    }
+    return 0;
+}
+
+static void track(struct session_t *s, pid_t pid)
+{
+    if (s->ntracked == s->trackedsize) {
+	s->trackedsize = s->trackedsize ? s->trackedsize * 2 : 16;
+	if ((s->tracked = realloc(s->tracked, s->trackedsize * sizeof(pid_t))) == NULL)
+	    fatal("realloc");
+    }
+    s->tracked[s->ntracked++] = pid;
+}
+
+/*
+ * quiet - True if the shell and every process it started (still counting
+ *     ones orphaned since) are blocked, stopped or dead
+ */
+int quiet(struct session_t *s)
+{
+    struct proc_t *pr;
+    int i, grew;
+
+    scanprocs();
+    if (!s->reaped && !tracking(s, s->pid))
+	track(s, s->pid);
+    do {
+	grew = 0;
+	for (i = 0; i < nprocs; i++) {
+	    if (!tracking(s, procs[i].pid) && tracking(s, procs[i].ppid)) {
+		track(s, procs[i].pid);
+		grew = 1;
+	    }
+	}
+    } while (grew);
+    for (i = 0; i < s->ntracked; ) {
+	if ((pr = findproc(s->tracked[i])) == NULL) {
+	    s->tracked[i] = s->tracked[--s->ntracked];
+	    continue;
+	}
+	if (pr->state == 'R' || pr->state == 'D')
+	    return 0;
+	i++;
+    }
+    return 1;
+}
+
+/*
+ * lingering - True while a process the session started is still around
+ *     and not stopped
+ */
+int lingering(struct session_t *s)
+{
+    struct proc_t *pr;
+    int i;
+
+    scanprocs();
+    for (i = 0; i < s->ntracked; i++) {
+	if ((pr = findproc(s->tracked[i])) != NULL && pr->state != 'T')
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * hangup - The shell is gone. A stopped job it left would now be in an
+ *     orphaned process group, and the kernel would send the group SIGHUP
+ *     and SIGCONT; but we adopted the job (see main), so its group isn't
+ *     orphaned. Send them ourselves.
+ */
+void hangup(struct session_t *s)
+{
+    struct proc_t *pr;
+    pid_t pgid;
+    int i;
+
+    if (!vtime || s->hungup)
+	return;
+    s->hungup = 1;
+    quiet(s); /* brings s->tracked up to date */
+    for (i = 0; i < s->ntracked; i++) {
+	if ((pr = findproc(s->tracked[i])) != NULL && pr->state == 'T' &&
+	    (pgid = getpgid(pr->pid)) > 0 && pgid != getpgrp()) {
+	    kill(-pgid, SIGHUP);
+	    kill(-pgid, SIGCONT);
+	}
+    }
+    procsfresh = 0;
+}
+
+/*
+ * settle - Look (in real time) until three looks in a row find the
+ *     session's processes quiet. Returns 0 until they have, or until
+ *     WAITLIMIT is up.
+ */
+int settle(struct session_t *s)
+{
+    double t = now();
+
+    if (!s->settling) {
+	s->settling = 1;
+	s->looks = 0;
+	s->lastlook = 0;
+	s->settledeadline = t + WAITLIMIT;
+    }
+    if (t - s->lastlook >= LOOK) {
+	s->lastlook = t;
+	s->looks = quiet(s) ? s->looks + 1 : 0;
+    }
+    if (s->looks < 3 && t < s->settledeadline) {
+	s->wake = s->lastlook + LOOK;
+	return 0;
+    }
+    s->settling = 0;
+    return 1;
+}
+
+/*
+ * vstep - SLEEP in virtual time: settle, then move the clock to the next
+ *     sleeper's deadline (nothing can happen before it), settling after
+ *     each move, until it reaches s->vtarget. Returns 1 once it has.
+ */
+int vstep(struct session_t *s)
+{
+    long long next;
+
+    while (settle(s)) {
+	if (s->vnow >= s->vtarget)
+	    return 1;
+	next = nextwake(s);
+	s->vnow = next < s->vtarget ? next : s->vtarget;
+	setclock(s);
+    }
+    return 0;
+}
+
+/*
+ * nextwake - The earliest deadline after s->vnow that a sleeper has
+ *     added to the clock file (see vclock.h), VFOREVER if there is none
+ */
+long long nextwake(struct session_t *s)
+{
+    struct stat st;
+    long long next = VFOREVER, t;
+    char *buf, *p;
+    ssize_t n;
+
+    if (fstat(s->clockfd, &st) < 0 || (buf = malloc(st.st_size + 1)) == NULL)
+	fatal("ERROR: Couldn't read %s: %s", s->clockpath, strerror(errno));
+    n = pread(s->clockfd, buf, st.st_size, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    for (p = strchr(buf, '\n'); p != NULL; p = strchr(p, '\n')) { /* skip the clock */
+	t = strtoll(++p, NULL, 10);
+	if (t > s->vnow && t < next)
+	    next = t;
+    }
+    free(buf);
+    return next;
+}
+
+/*
+ * setclock - Set the session's virtual clock to s->vnow ms
+ */
+void setclock(struct session_t *s)
+{
+    char buf[32];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%020lld\n", s->vnow);
+    if (pwrite(s->clockfd, buf, n, 0) != n)
+	fatal("ERROR: Couldn't set the clock in %s: %s", s->clockpath, strerror(errno));
+    procsfresh = 0; /* sleepers may be waking up */
+}
+
+/*********************
+ * Helper routines
+ *********************/
+
+/*
+ * sigchld_handler - Wake up the main loop's poll
+ */
+void sigchld_handler(int sig)
+{
+    int olderrno = errno;
+
+    if (write(chldpipe[1], "", 1) < 0)
+	; /* pipe full: the loop is awake already */
+    errno = olderrno;
+}
+
+/*
+ * now - Monotonic time in seconds
+ */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * writeall - Write all of buf to the shell; if it has gone, so be it
+ */
+void writeall(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;
+	}
+	buf += n;
+	len -= n;
+    }
+}
+
+/*
+ * say - Print a line to a session's log, stamped under -T
+ */
+void say(struct session_t *s, char *fmt, ...)
+{
+    va_list ap;
+
+    if (stamps)
+	fprintf(s->log, "%10.3f ", (now() - s->start) * 1e3);
+    va_start(ap, fmt);
+    vfprintf(s->log, fmt, ap);
+    va_end(ap);
+    fputc('\n', s->log);
+}
+
+/*
+ * note - say() what the driver is doing, under -v
+ */
+void note(struct session_t *s, char *fmt, ...)
+{
+    char buf[MAXLINE * 2];
+    va_list ap;
+
+    if (!verbose)
+	return;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    say(s, "%s: %s", progname, buf);
+}
+
+/*
+ * complain - Warn about a session: on stderr, or with -o in its log
+ */
+void complain(struct session_t *s, char *fmt, ...)
+{
+    char buf[MAXLINE * 2];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (outdir != NULL)
+	say(s, "%s: %s", progname, buf);
+    else
+	fprintf(stderr, "%s: %s\n", progname, buf);
+}
+
+/*
+ * fatal - Print an error and exit
+ */
+void fatal(char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", progname);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * usage - Print a help message and exit
+ */
+void usage(void)
+{
+    fprintf(stderr, "Usage: %s [-hvgVPT] -t <trace> -s <shell> [-a <args>]\n", progname);
+    fprintf(stderr, "       %s [-vVPT] [-j <n>] -o <dir> -s <shell>... [-a <args>] <trace>...\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h            Print this message\n");
+    fprintf(stderr, "  -v            Be more verbose\n");
+    fprintf(stderr, "  -t <trace>    Trace file\n");
+    fprintf(stderr, "  -s <shell>    Shell program to test (with -o, any number)\n");
+    fprintf(stderr, "  -a <args>     Shell arguments\n");
+    fprintf(stderr, "  -g            Generate output for autograder\n");
+    fprintf(stderr, "  -V            Run the test programs on a virtual clock\n");
+    fprintf(stderr, "  -P            Run the shell on a pseudo-terminal instead of pipes\n");
+    fprintf(stderr, "  -T            Print output as it comes, with timestamps in ms\n");
+    fprintf(stderr, "  -o <dir>      Run every trace on every shell, outputs in <dir>\n");
+    fprintf(stderr, "  -j <n>        With -o, at most <n> shells at a time (default: all)\n");
+    exit(1);
+}
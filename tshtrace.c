@@ -0,0 +1,117 @@
+/*
+ * tshtrace.c - Print a tsh -t event trace as a timeline
+ *
+ * usage: tshtrace [-h] [-r] <trace file>
+ *
+ * Reads the ring that "tsh -t <trace file>" wrote and prints its records
+ * oldest first: time since the first record, time since the previous
+ * one, the event, the process and job, and what the event says. With
+ * -r the numbers are printed raw (nanoseconds, wait status) for scripts.
+ *
+ * This file includes tsh.c with TSH_NO_MAIN, so the record layout and
+ * event names always match the shell that wrote the trace.
+ */
+#define TSH_NO_MAIN
+#include "tsh.c"
+
+static void traceusage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-r] <trace file>\n", prog);
+    fprintf(stderr, "   -h   print this message\n");
+    fprintf(stderr, "   -r   raw output: nanoseconds and wait statuses\n");
+    exit(1);
+}
+
+/* detail - Describe what a record's arg means for its type */
+static void detail(struct tracerec_t *rec, char *buf, size_t size)
+{
+    int status = rec->arg;
+
+    switch (rec->type) {
+    case TR_ADDJOB:
+	snprintf(buf, size, "%d process%s", rec->arg, rec->arg == 1 ? "" : "es");
+	break;
+    case TR_LAUNCH:
+	snprintf(buf, size, "pgid %d", rec->arg);
+	break;
+    case TR_STOP:
+    case TR_CONT:
+    case TR_SIGNAL:
+	snprintf(buf, size, "%s", strsignal(rec->arg));
+	break;
+    case TR_REAP:
+	if (WIFEXITED(status))
+	    snprintf(buf, size, "exit %d", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+	    snprintf(buf, size, "killed: %s", strsignal(WTERMSIG(status)));
+	else
+	    snprintf(buf, size, "status 0x%x", status);
+	break;
+    default:
+	buf[0] = '\0';
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct tracehdr_t hdr;
+    struct tracerec_t *recs, *rec;
+    uint64_t first, i, n;
+    int64_t start, prev;
+    char buf[64];
+    int c, fd, raw = 0;
+
+    while ((c = getopt(argc, argv, "hr")) != EOF) {
+	switch (c) {
+	case 'r':
+	    raw = 1;
+	    break;
+	default:
+	    traceusage(argv[0]);
+	}
+    }
+    if (optind != argc - 1)
+	traceusage(argv[0]);
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 ||
+	read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+	perror(argv[optind]);
+	exit(1);
+    }
+    if (memcmp(hdr.magic, "tshtrace", 8) != 0 ||
+	hdr.recsize != sizeof(struct tracerec_t) || hdr.nrecs == 0) {
+	fprintf(stderr, "%s: not a tsh trace, or from a different tsh\n", argv[optind]);
+	exit(1);
+    }
+
+    /* Once the ring has wrapped only the newest nrecs records are left */
+    n = hdr.head < hdr.nrecs ? hdr.head : hdr.nrecs;
+    first = hdr.head - n;
+    if ((recs = malloc(hdr.nrecs * sizeof(*recs))) == NULL ||
+	read(fd, recs, hdr.nrecs * sizeof(*recs)) != (ssize_t) (hdr.nrecs * sizeof(*recs))) {
+	fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+	exit(1);
+    }
+    close(fd);
+
+    if (first > 0)
+	printf("# %llu older records were overwritten\n", (unsigned long long) first);
+    if (!raw)
+	printf("%12s %12s  %-7s %7s %5s  %s\n", "time(us)", "+us", "event", "pid", "jid", "detail");
+    start = prev = n ? recs[first % hdr.nrecs].ns : 0;
+    for (i = first; i < hdr.head; i++) {
+	rec = &recs[i % hdr.nrecs];
+	if (rec->type < 0 || rec->type >= TR_NTYPES) /* torn by a crash mid-append */
+	    continue;
+	if (raw) {
+	    printf("%lld %s %d %d %d\n", (long long) rec->ns, tracenames[rec->type],
+		   rec->pid, rec->jid, rec->arg);
+	} else {
+	    detail(rec, buf, sizeof(buf));
+	    printf("%12.3f %12.3f  %-7s %7d %5d  %s\n", (rec->ns - start) / 1e3,
+		   (rec->ns - prev) / 1e3, tracenames[rec->type], rec->pid, rec->jid, buf);
+	}
+	prev = rec->ns;
+    }
+    exit(0);
+}
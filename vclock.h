@@ -0,0 +1,66 @@
+/*
+ * vclock.h - sleep() for the test programs, on the trace driver's
+ *     virtual clock when there is one
+ *
+ * sdriver.pl -V runs a trace in virtual time: it puts the name of a
+ * clock file in TSH_VCLOCK, and the file's first line holds a decimal
+ * count of milliseconds that the driver advances instead of sleeping.
+ * vsleep waits until that clock has moved on by secs seconds. Without
+ * TSH_VCLOCK it is just sleep.
+ *
+ * Each vsleep also appends its deadline to the file, one line each, so
+ * tshdriver can move the clock straight to the next one instead of
+ * stepping, and it waits for the clock to be written (inotify) rather
+ * than polling it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+/* vclock_read - Current virtual time in ms, -1 if it can't be read */
+static long long vclock_read(int fd)
+{
+    char buf[32];
+    ssize_t n;
+
+    if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+	return -1;
+    buf[n] = '\0';
+    return atoll(buf);
+}
+
+/* vsleep - Sleep for secs seconds of virtual time, or of real time */
+static unsigned int vsleep(unsigned int secs)
+{
+    static int fd = -2, wfd = -1;
+    struct timespec tick = { 0, 1000000 }; /* real time between looks, without inotify */
+    char ev[sizeof(struct inotify_event) + 64], line[32];
+    long long now, deadline;
+    char *path;
+    int n;
+
+    if (fd == -2) {
+	path = getenv("TSH_VCLOCK");
+	fd = path != NULL ? open(path, O_RDWR | O_APPEND | O_CLOEXEC) : -1;
+	if (fd >= 0 && (wfd = inotify_init1(IN_CLOEXEC)) >= 0 &&
+	    inotify_add_watch(wfd, path, IN_MODIFY) < 0) {
+	    close(wfd);
+	    wfd = -1;
+	}
+    }
+    if (fd < 0 || (now = vclock_read(fd)) < 0)
+	return sleep(secs);
+
+    deadline = now + secs * 1000LL;
+    n = snprintf(line, sizeof(line), "%lld\n", deadline);
+    if (write(fd, line, n) != n)
+	return sleep(secs);
+    while ((now = vclock_read(fd)) >= 0 && now < deadline) {
+	if (wfd < 0 || read(wfd, ev, sizeof(ev)) < 0)
+	    nanosleep(&tick, NULL);
+    }
+    return 0;
+}